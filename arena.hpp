@@ -0,0 +1,80 @@
+// bump allocator owning everything parsed from one file; it is released as a
+// whole when the file is unloaded instead of node by node
+
+#include <memory>
+#include <type_traits>
+
+class Arena {
+    static const size_t CHUNK = 64*1024;
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    char *cur = NULL;
+    size_t left = 0;
+
+    // destructors of objects that need one, run in reverse order of construction
+    struct Dtor {
+        void (*fn)(void *);
+        void *obj;
+    };
+    std::vector<Dtor> dtors;
+
+    void *alloc(size_t size, size_t align) {
+        size_t pad = (align - (uintptr_t)cur%align) % align;
+        if(pad+size > left) {
+            size_t cap = size+align > CHUNK ? size+align : CHUNK;
+            chunks.emplace_back(new char[cap]);
+            cur = chunks.back().get();
+            left = cap;
+            pad = (align - (uintptr_t)cur%align) % align;
+        }
+        char *ret = cur+pad;
+        cur += pad+size;
+        left -= pad+size;
+        bytes += size;
+        return ret;
+    }
+
+public:
+    size_t bytes = 0; // allocated so far
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena &operator=(const Arena&) = delete;
+    Arena(Arena &&o) noexcept { *this = std::move(o); }
+    Arena &operator=(Arena &&o) noexcept {
+        if(this != &o) {
+            Clear();
+            chunks = std::move(o.chunks);
+            dtors = std::move(o.dtors);
+            cur = o.cur; left = o.left; bytes = o.bytes;
+            o.cur = NULL; o.left = 0; o.bytes = 0;
+        }
+        return *this;
+    }
+    ~Arena() { Clear(); }
+
+    template<typename T, typename... Args>
+    T *make(Args&&... args) {
+        T *obj = new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if(!std::is_trivially_destructible<T>::value)
+            dtors.push_back(Dtor { [] (void *p) { ((T*)p)->~T(); }, obj });
+        return obj;
+    }
+
+    // copy of text that is not part of the file buffer
+    std::string_view copy(std::string_view sv) {
+        if(!sv.length()) return std::string_view();
+        char *mem = (char*)alloc(sv.length(), 1);
+        memcpy(mem, sv.data(), sv.length());
+        return std::string_view(mem, sv.length());
+    }
+
+    void Clear() {
+        for(auto it=dtors.rbegin(); it!=dtors.rend(); ++it) it->fn(it->obj);
+        dtors.clear();
+        chunks.clear();
+        cur = NULL;
+        left = 0;
+        bytes = 0;
+    }
+};
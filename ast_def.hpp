@@ -1,17 +1,56 @@
 // AST structure (struct ConfyFile is opaque)
+// Source fragments are views into the ConfyFile's data buffer, which lives as
+// long as the file; only text produced at runtime (template output) is owned.
 struct ConfyFile;
 struct ConfyState;
+struct CacheWriter;
+struct CacheReader;
+struct ExprCompiler;
+struct ExprCode;
+struct ExecMemo;
 
 struct SyntaxNode {
-    virtual std::string Render(int fid, ConfyState *st) =0;
+    ExecMemo *memo = NULL; // of the last execution as a statement, see exec.hpp
+
+    // output of Render kept until the node or one of its descendants calls
+    // Changed, so that re-rendering after a small change doesn't rebuild
+    // the parts that stayed the same
+    SyntaxNode *parent = NULL; // NULL for the root of a file
+    std::string rendered;
+    bool rendered_ok = false;
+
+    // leaves render themselves; nodes containing others get it from Stream,
+    // measured first so that the result is allocated once
+    virtual std::string Render(int fid, ConfyState *st);
+    // Render output, from the cache if valid; nodes whose output is a piece
+    // of the source return that instead
+    virtual std::string_view Output(int fid, ConfyState *st);
+    void Changed();
     virtual ConfyVal Execute(int fid, ConfyState *st, bool enable) =0;
+    // same output as Render, written out piecewise without copying: pieces
+    // are source views or node members, which stay put while output is
+    // written
+    virtual void Stream(int fid, ConfyState *st, Sink &w);
+
+    // parse cache serialization, see cache.hpp
+    virtual void Save(CacheWriter &w) =0;
+    virtual void Load(CacheReader &r) =0;
+
+    // cheaper to execute again than to track, and touches no variables
+    virtual bool Untracked() { return false; }
+    // append the output as active code if it is the same every time, i.e.
+    // the node is plain text
+    virtual bool ActiveText(std::string &out) { return false; }
 };
 
 struct Seq : public SyntaxNode {
     std::vector<SyntaxNode*> children;
 
-    virtual std::string Render(int fid, ConfyState *st);
     virtual ConfyVal Execute(int fid, ConfyState *st, bool enable);
+    virtual void Stream(int fid, ConfyState *st, Sink &w);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
+    virtual bool ActiveText(std::string &out);
 };
 
 
@@ -22,106 +61,175 @@ struct SourceBlock : public SyntaxNode {
         B_INERT_BLOCK,
         B_META_CHAFF
     } bType;
-    std::string contents;
+    std::string_view contents;
 
     virtual std::string Render(int fid, ConfyState *st);
+    virtual std::string_view Output(int fid, ConfyState *st);
     virtual ConfyVal Execute(int fid, ConfyState *st, bool enable);
+    virtual void Stream(int fid, ConfyState *st, Sink &w);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
+    virtual bool Untracked() { return true; }
+    virtual bool ActiveText(std::string &out) { out += contents; return true; }
 };
 
 struct IfThen : public SyntaxNode {
-    std::string pre, post;
+    std::string_view pre, post;
 
     SyntaxNode *cond, *sub;
 
-    virtual std::string Render(int fid, ConfyState *st);  
     virtual ConfyVal Execute(int fid, ConfyState *st, bool enable);
+    virtual void Stream(int fid, ConfyState *st, Sink &w);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 
 struct IfThenElse : public SyntaxNode {
-    std::string pre, inter, post;
+    std::string_view pre, inter, post;
 
     SyntaxNode *cond, *sub1, *sub2;
+    bool swapped = false; // sub2 ran first last time
 
-    virtual std::string Render(int fid, ConfyState *st);
     virtual ConfyVal Execute(int fid, ConfyState *st, bool enable);
+    virtual void Stream(int fid, ConfyState *st, Sink &w);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 
 struct Template : public SyntaxNode {
-    std::string pre, inter, post;
+    std::string_view pre, inter, post;
     
     SyntaxNode *temp;
     std::string out;
 
-    virtual std::string Render(int fid, ConfyState *st);
+    // a plain text pattern is split up once into literal text and the
+    // variables to substitute; others are rendered and scanned every time
+    struct Piece {
+        std::string_view text; // literal text, or the variable name
+        int slot;              // -1 for literal text
+    };
+    bool compiled = false;
+    std::string pattern_text;
+    std::vector<Piece> pieces;
+    size_t literal_len = 0;
+    void Compile();
+    void Substitute(int fid, ConfyState *st);
+
     virtual ConfyVal Execute(int fid, ConfyState *st, bool enable);
+    virtual void Stream(int fid, ConfyState *st, Sink &w);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 
 struct Include : public SyntaxNode {
-    std::string source;
+    std::string_view source;
     std::string fname;
+    int target = -1; // index of the file once it was loaded
 
     virtual std::string Render(int fid, ConfyState *st);
+    virtual std::string_view Output(int fid, ConfyState *st) { return source; }
     virtual ConfyVal Execute(int fid, ConfyState *st, bool enable);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 
 struct Expr {
     virtual ConfyVal Eval(int fid, ConfyState *st) = 0;
+    // emit code leaving the value in register dst, see bytecode.hpp; returns
+    // the static type of the value if known
+    virtual int Compile(ExprCompiler &c, int dst) = 0;
+
+    virtual void Save(CacheWriter &w) =0;
+    virtual void Load(CacheReader &r) =0;
 };
 struct ExprVar : public Expr {
     std::string name;
+    int slot; // in the symbol table
     virtual ConfyVal Eval(int fid, ConfyState *st);
+    virtual int Compile(ExprCompiler &c, int dst);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 struct ExprLiteral : public Expr {
     ConfyVal v;
     virtual ConfyVal Eval(int fid, ConfyState *st);
+    virtual int Compile(ExprCompiler &c, int dst);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 struct ExprOp : public Expr {
+    int tier; // index into opTiers
     std::function<ConfyVal (ConfyVal,ConfyVal,int)> op;
     std::vector<Expr*> subexprs;
     std::vector<int> subtypes;
     virtual ConfyVal Eval(int fid, ConfyState *st);
+    virtual int Compile(ExprCompiler &c, int dst);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 struct ExprNot : public Expr {
     Expr *sub;
     virtual ConfyVal Eval(int fid, ConfyState *st);   
+    virtual int Compile(ExprCompiler &c, int dst);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 struct ExprNeg : public Expr {
     Expr *sub;
     virtual ConfyVal Eval(int fid, ConfyState *st);   
+    virtual int Compile(ExprCompiler &c, int dst);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 
 struct ExprEq : public Expr {
     Expr *left, *right;
     virtual ConfyVal Eval(int fid, ConfyState *st);
+    virtual int Compile(ExprCompiler &c, int dst);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 
 struct ExprNode : public SyntaxNode {
     Expr *root;
-    std::string source;
+    ExprCode *code = NULL; // NULL if it could not be compiled
+    std::string_view source;
+
+    void Compile(Arena &arena);
 
     virtual std::string Render(int fid, ConfyState *st);
+    virtual std::string_view Output(int fid, ConfyState *st) { return source; }
     virtual ConfyVal Execute(int fid, ConfyState *st, bool enable);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 
 struct VarDef : public SyntaxNode {
-    std::string pre, post;
+    std::string_view pre, post;
 
     std::string name;
+    int slot;
     bool hidden;    
 
     ConfyVar v;
 
     virtual std::string Render(int fid, ConfyState *st);
     virtual ConfyVal Execute(int fid, ConfyState *st, bool enable);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 
 struct VarAssign : public SyntaxNode {
-    std::string source;
+    std::string_view source;
 
     std::string varname;
+    int slot;
     SyntaxNode *expr;
 
     virtual std::string Render(int fid, ConfyState *st);
+    virtual std::string_view Output(int fid, ConfyState *st) { return source; }
     virtual ConfyVal Execute(int fid, ConfyState *st, bool enable);
+    virtual void Save(CacheWriter &w);
+    virtual void Load(CacheReader &r);
 };
 
@@ -1,16 +1,52 @@
 // AST functions implementations
 
-std::string Seq::Render(int fid, ConfyState *st) {
+void SyntaxNode::Stream(int fid, ConfyState *st, Sink &w) {
+    w.Write(Output(fid, st));
+}
+
+std::string SyntaxNode::Render(int fid, ConfyState *st) {
+    MeasureSink m;
+    Stream(fid, st, m);
     std::string ret;
-    for(auto n : children) 
-        ret += n->Render(fid, st);
+    ret.reserve(m.size);
+    StringSink s(ret);
+    Stream(fid, st, s);
     return ret;
 }
 
+std::string_view SyntaxNode::Output(int fid, ConfyState *st) {
+    if(!rendered_ok) {
+        rendered = Render(fid, st);
+        rendered_ok = true;
+    }
+    return rendered;
+}
+
+// nodes containing others may have a cache while some of those don't, so
+// this goes all the way up
+void SyntaxNode::Changed() {
+    for(SyntaxNode *n=this; n; n=n->parent)
+        n->rendered_ok = false;
+}
+
+// nodes containing others stream from their cache if they have one, but
+// don't make one: that would keep a second copy of the whole file around
+bool Seq::ActiveText(std::string &out) {
+    for(auto n : children)
+        if(!n->ActiveText(out)) return false;
+    return true;
+}
+
+void Seq::Stream(int fid, ConfyState *st, Sink &w) {
+    if(rendered_ok) return w.Write(rendered);
+    for(auto n : children)
+        n->Stream(fid, st, w);
+}
+
 ConfyVal Seq::Execute(int fid, ConfyState *st, bool enable) {
     ConfyVal ret;
     for(auto n : children)
-        ret = n->Execute(fid,st,enable);
+        ret = st->Run(n,fid,enable);
     return ret;
 }
 
@@ -23,31 +59,39 @@ std::string VarDef::Render(int fid, ConfyState *st) {
 }
 
 ConfyVal VarDef::Execute(int fid, ConfyState *st, bool enable) {
-    if(!st->vars.count(name)) {
-        st->vars[name] = v;
-        st->vars[name].fl = fid;
-        st->vars[name].hidden = hidden;
-        st->varNames.push_back(name);
+    st->exec.Read(slot);
+    ConfyVar *var = st->Var(slot);
+    if(!var) {
+        st->exec.Write(slot, st->vars);
+        if(slot>=st->vars.size()) st->vars.resize(slot+1);
+        var = &st->vars[slot];
+        *var = v;
+        var->fl = fid;
+        var->defined = true;
+        st->varSlots.push_back(slot);
     } else {
         // backprop from state
-        v = st->vars[name];
+        if(!v.val.Same(var->val)) Changed();
+        st->exec.Changing(this);
+        v = *var;
     }
-    st->vars[name].hidden = hidden || !enable;
-    return ConfyVal { T_BOOL, true, 1, 1.0, "true" };
+    st->exec.Hide(slot);
+    var->hidden = hidden || !enable;
+    return boolVal(true);
 }
 
-std::string lineify(std::string input, std::string comment)
+std::string lineify(std::string_view input, const std::string &comment)
 {
-    int pos=0, pos0=0;
+    size_t pos=0, pos0=0;
     std::string out;
     while( (pos=input.find('\n', pos0)) != std::string::npos) {
         out += comment;
-        out += std::string(input, pos0, pos-pos0+1);
+        out += input.substr(pos0, pos-pos0+1);
         pos0 = pos+1; 
     }
-    if(input[pos0]) {
+    if(pos0<input.length()) {
         out += comment;
-        out += std::string(input, pos0);
+        out += input.substr(pos0);
         out += "\n";
     }
     return out;
@@ -61,56 +105,75 @@ std::string SourceBlock::Render(int fid, ConfyState *st) {
         ret += st->files[fid].setup.block_start;
         ret += contents;
         ret += st->files[fid].setup.block_end;
-    } else ret = contents;
+    } else ret = std::string(contents);
     return ret;
 }
 
+std::string_view SourceBlock::Output(int fid, ConfyState *st) {
+    if(bType == B_ACTIVE || bType == B_META_CHAFF) return contents;
+    return SyntaxNode::Output(fid, st);
+}
+
+void SourceBlock::Stream(int fid, ConfyState *st, Sink &w) {
+    if(bType == B_INERT_LINE) {
+        w.Write(Output(fid, st));
+    } else if(bType == B_INERT_BLOCK) {
+        w.Write(st->files[fid].setup.block_start);
+        w.Write(contents);
+        w.Write(st->files[fid].setup.block_end);
+    } else w.Write(contents);
+}
+
 ConfyVal SourceBlock::Execute(int fid, ConfyState *st, bool enable) {
-    if(bType == B_META_CHAFF) return { T_BOOL, true, 1, 1.0, "true" };
+    if(bType == B_META_CHAFF) return boolVal(true);
 
+    auto old = bType;
     if(enable) bType=B_ACTIVE;
     else if(st->files[fid].setup.line.length() && contents.find('\n')==(contents.length()-1)) bType=B_INERT_LINE;
     else if(st->files[fid].setup.block_start.length()) bType=B_INERT_BLOCK;
     else bType=B_INERT_LINE;
+    if(bType!=old) Changed();
 
-    return ConfyVal { T_BOOL, true, 1, 1.0, "true" };
+    return boolVal(true);
 }
 
-std::string IfThen::Render(int fid, ConfyState *st) {
-    std::string ret;
-    ret += pre;
-    ret += sub->Render(fid,st);
-    ret += post;
-    return ret;
+void IfThen::Stream(int fid, ConfyState *st, Sink &w) {
+    if(rendered_ok) return w.Write(rendered);
+    w.Write(pre);
+    sub->Stream(fid,st,w);
+    w.Write(post);
 }
 
 ConfyVal IfThen::Execute(int fid, ConfyState *st, bool enable) {
-    ConfyVal v { T_BOOL, false, 0, 0.0, "false" };
+    ConfyVal v = boolVal(false);
     if(!enable) sub->Execute(fid,st,false);
     else {
         v = cond->Execute(fid,st,true);
-        sub->Execute(fid,st,v.b);
+        sub->Execute(fid,st,v.AsBool());
     }
     return v; 
 }
 
-std::string IfThenElse::Render(int fid, ConfyState *st) {
-    std::string ret;
-    ret += pre;
-    ret += sub1->Render(fid,st);
-    ret += inter;
-    ret += sub2->Render(fid,st);
-    ret += post;
-    return ret;
+void IfThenElse::Stream(int fid, ConfyState *st, Sink &w) {
+    if(rendered_ok) return w.Write(rendered);
+    w.Write(pre);
+    sub1->Stream(fid,st,w);
+    w.Write(inter);
+    sub2->Stream(fid,st,w);
+    w.Write(post);
 }
 
 ConfyVal IfThenElse::Execute(int fid, ConfyState *st, bool enable) {
-    ConfyVal v { T_BOOL, false, 0, 0.0, "false" };
+    ConfyVal v = boolVal(false);
+    if(enable) v = cond->Execute(fid,st,true);
+    bool swap = enable && v.AsBool();
+    if(swap!=swapped) st->exec.Reorder();
+    swapped = swap;
+
     if(!enable) { sub1->Execute(fid,st,false); sub2->Execute(fid,st,false); }
     else {
-        v = cond->Execute(fid,st,true);
         // always shadow-execute non-taken branch first, for variable shadowing
-        if(v.b) {
+        if(v.AsBool()) {
             sub2->Execute(fid,st,false);
             sub1->Execute(fid,st,true);
         } else {
@@ -121,25 +184,88 @@ ConfyVal IfThenElse::Execute(int fid, ConfyState *st, bool enable) {
     return v; 
 }
 
-std::string Template::Render(int fid, ConfyState *st) {
-    std::string ret;
-    ret += pre;
-    ret += temp->Render(fid,st);
-    ret += inter;
-    ret += out;
-    ret += post;
-    return ret;
+void Template::Stream(int fid, ConfyState *st, Sink &w) {
+    if(rendered_ok) return w.Write(rendered);
+    w.Write(pre);
+    temp->Stream(fid,st,w);
+    w.Write(inter);
+    w.Write(out);
+    w.Write(post);
+}
+
+void Template::Compile() {
+    pieces.clear();
+    pattern_text.clear();
+    literal_len = 0;
+    compiled = temp->ActiveText(pattern_text);
+    if(!compiled) return;
+
+    // same rules as the scan in Execute
+    const char *s = pattern_text.c_str();
+    size_t len = pattern_text.length(), pos = 0, pos0 = 0;
+    auto literal = [&] (size_t end) {
+        if(end==pos0) return;
+        pieces.push_back(Piece { std::string_view(s+pos0, end-pos0), -1 });
+        literal_len += end-pos0;
+    };
+    while((pos = pattern_text.find_first_of("$\\", pos)) != std::string::npos) {
+        literal(pos);
+        if(s[pos]=='\\') {
+            pos0 = ++pos;
+            if(pos<len) ++pos; // skip next character
+        } else {
+            offs_t p = pos+1;
+            std::string_view name = capture_ident(s, NULL, &p);
+            pieces.push_back(Piece { name, symbols.Slot(name) });
+            pos = p;
+            if(s[pos]=='~') ++pos;
+            pos0 = pos;
+        }
+    }
+    literal(len);
+}
+
+// output of a compiled pattern, sized before it is filled in
+void Template::Substitute(int fid, ConfyState *st) {
+    size_t n = literal_len;
+    for(auto &p : pieces) {
+        if(p.slot<0) continue;
+        st->exec.Read(p.slot);
+        ConfyVar *var = st->Var(p.slot);
+        if(!var) n += p.text.length()+21;
+        else if(var->val.k>=K_LITERAL) n += var->val.Str().length();
+        else n += 24;
+    }
+    std::string result;
+    result.reserve(n);
+    for(auto &p : pieces) {
+        if(p.slot<0) result += p.text;
+        else if(ConfyVar *var = st->Var(p.slot)) var->val.AppendText(result);
+        else {
+            result += "<unknown variable $";
+            result += p.text;
+            result += ">";
+        }
+    }
+    if(result!=out) Changed();
+    out = std::move(result);
 }
 
 ConfyVal Template::Execute(int fid, ConfyState *st, bool enable) {
-    ConfyVal v { T_BOOL, false, 0, 0.0, "false" };
-    if(!enable) { out=""; }
-    else {
+    ConfyVal v = boolVal(false);
+    if(!enable) {
+        if(!out.empty()) Changed();
+        out="";
+    } else if(compiled) {
+        Substitute(fid,st);
+        temp->Execute(fid,st,false);
+    } else {
         temp->Execute(fid,st,true);
-        out = temp->Render(fid,st);
+        std::string prev = std::move(out);
+        out = temp->Output(fid,st);
         std::string result;
         /* substitute variable names */
-        int pos=0,pos0=0;
+        offs_t pos=0,pos0=0;
         while(pos<out.length()) {
             if(out[pos]=='\\') {
                 result.append(out,pos0,pos-pos0); // emit accumulated interval
@@ -149,17 +275,20 @@ ConfyVal Template::Execute(int fid, ConfyState *st, bool enable) {
             } else if(out[pos]=='$') {
                 result.append(out,pos0,pos-pos0); // emit accumulated interval
                 ++pos; // advance past $
-                std::string varname = capture_ident(out.c_str(), NULL, &pos);
+                std::string varname(capture_ident(out.c_str(), NULL, &pos));
                 if(out[pos]=='~') ++pos; // advance past ~ for $varname~text
                 pos0=pos;
                 // append string value of this variable
-                if(!st->vars.count(varname))
-                    result += "<unknown variable $"+varname+">";
+                int slot = symbols.Slot(varname);
+                st->exec.Read(slot);
+                if(ConfyVar *var = st->Var(slot))
+                    var->val.AppendText(result);
                 else
-                    result += st->vars[varname].val.s;
+                    result += "<unknown variable $"+varname+">";
             } else ++pos;
         }
         result.append(out,pos0); // emit tail
+        if(result!=prev) Changed();
         out = result;
 
         temp->Execute(fid,st,false);
@@ -169,16 +298,13 @@ ConfyVal Template::Execute(int fid, ConfyState *st, bool enable) {
 
 
 std::string ExprNode::Render(int fid, ConfyState *st) {
-    return source;
-}
-
-ConfyVal ExprNode::Execute(int fid, ConfyState *st, bool enable) {
-    return root->Eval(fid,st);
+    return std::string(source);
 }
 
 ConfyVal ExprVar::Eval(int fid, ConfyState *st) {
-    if(!st->vars.count(name)) return ConfyVal { T_BOOL, false, 0, 0.0, "false" };
-    return st->vars[name].val;
+    st->exec.Read(slot);
+    ConfyVar *var = st->Var(slot);
+    return var ? var->val : boolVal(false);
 }
 ConfyVal ExprLiteral::Eval(int fid, ConfyState *st) {
     return v;
@@ -192,11 +318,11 @@ ConfyVal ExprOp::Eval(int fid, ConfyState *st) {
 }
 ConfyVal ExprNot::Eval(int fid, ConfyState *st) {
     ConfyVal vsub = sub->Eval(fid,st);
-    return boolVal(!vsub.b);
+    return boolVal(!vsub.AsBool());
 }
 ConfyVal ExprNeg::Eval(int fid, ConfyState *st) {
     ConfyVal vsub = sub->Eval(fid,st);
-    return vsub.t==T_FLOAT?floatVal(-vsub.f):intVal(-vsub.i);
+    return vsub.t==T_FLOAT?floatVal(-vsub.AsFloat()):intVal(-vsub.AsInt());
 }
 
 // check for equality, coercing to type of left
@@ -205,60 +331,63 @@ ConfyVal ExprEq::Eval(int fid, ConfyState *st) {
     ConfyVal r = right->Eval(fid,st);
     bool res;
     switch(l.t) {
-    case T_BOOL: res = l.b == r.b; break;
-    case T_INT: res = l.i == r.i; break;
-    case T_FLOAT: res = l.f == r.f; break;
-    case T_STRING: res = l.s == r.s; break;
+    case T_BOOL: res = l.AsBool() == r.AsBool(); break;
+    case T_INT: res = l.AsInt() == r.AsInt(); break;
+    case T_FLOAT: res = l.AsFloat() == r.AsFloat(); break;
+    case T_STRING: res = l.TextEquals(r); break;
     default: res = false;
     }
-    return ConfyVal { T_BOOL, res, res?1:0, res?1.0:0.0, res?"true":"false" };
+    return boolVal(res);
 }
 
 std::string VarAssign::Render(int fid, ConfyState *st) {
-    return source;
+    return std::string(source);
 }
 
 ConfyVal VarAssign::Execute(int fid, ConfyState *st, bool enable) {
     if(enable) {
-        if(st->vars.count(varname)) {
-            st->vars[varname].val.CoerceFrom(expr->Execute(fid,st,enable));
-            return st->vars[varname].val;
+        st->exec.Read(slot);
+        if(st->Var(slot)) {
+            ConfyVal val = expr->Execute(fid,st,enable);
+            st->exec.Write(slot, st->vars);
+            ConfyVar *var = st->Var(slot);
+            var->val.CoerceFrom(val);
+            return var->val;
         } else {
             // TODO: throw error?
         }
     }
-    return ConfyVal { T_BOOL, false, 0, 0.0, "false" };
+    return boolVal(false);
 }
 
 std::string Include::Render(int fid, ConfyState *st) {
-    return source;
+    return std::string(source);
 }
 
 ConfyVal Include::Execute(int fid, ConfyState *st, bool enable) {
     // load relative to this file ("absolute" wrt cwd)
-    std::string abspath;
-    std::filesystem::path fp(fname);
-    if(fp.is_absolute()) 
-        abspath = fname;
-    else {
-        abspath = st->files[fid].fpath;
-        if(abspath.length()) abspath+="/";
-        abspath+=fname;
+    if(target<0) {
+        std::string abspath = IncludePath(st->files[fid].fpath, fname);
+        target = enable ? st->LoadFile(abspath) : st->FindFile(abspath);
     }
 
     if(enable) {
-        // this will also execute the file included
-        if(st->LoadAndParseFile(abspath))
-            return ConfyVal { T_BOOL, true, 1, 1.0, "true" };
+        if(target>=0 && st->IncludeFile(target))
+            return boolVal(true);
+        st->exec.Pin(); // try again next time
     } else {
-        // hide all variables from this file if previously loaded
-        int i=st->FindFile(abspath);
-        for(auto &[k,v] : st->vars) {
-            if(v.fl == i)
-                v.hidden = true;
+        // hide all variables from this file if previously loaded; which
+        // those are isn't recorded, so this is never skipped
+        int i=target;
+        for(int k=0; k<st->vars.size(); ++k) {
+            if(st->vars[k].defined && st->vars[k].fl == i) {
+                st->exec.Hide(k);
+                st->vars[k].hidden = true;
+            }
         }
+        st->exec.Pin();
     }
-    return ConfyVal { T_BOOL, false, 0, 0.0, "false" };
+    return boolVal(false);
 }
 
 
@@ -0,0 +1,185 @@
+// batch mode: newline-delimited commands from a pipe or file, one reply
+// line each
+//
+//   get <var>             -> ok <value>
+//   set <var> <value>     -> ok
+//   unset-override <var>  -> ok; takes back the sets of var since the last commit
+//   commit, save          -> ok <n> written, <m> unchanged
+//   list                  -> ok <n>, then a line "<var> <value>" for each visible variable
+//
+// Sets change the variables at once, but the files only run again when a
+// get, list or commit needs them to, and are saved on commit and at the end
+// of the input. Blank lines and lines starting with '#' are skipped;
+// anything that fails replies "error <reason>". The same commands are
+// served over a socket by --serve, see serve.hpp.
+
+// next word of line, or empty at the end
+static std::string_view batch_word(std::string_view &line) {
+    size_t b = line.find_first_not_of(" \t");
+    if(b==std::string_view::npos) b = line.length();
+    size_t e = line.find_first_of(" \t", b);
+    if(e==std::string_view::npos) e = line.length();
+    std::string_view w = line.substr(b, e-b);
+    line.remove_prefix(e);
+    return w;
+}
+
+struct CommandSession {
+    ConfyState *st;
+    std::map<int, ConfyVal> overridden; // values before the first set since the last commit
+    std::map<int, ConfyVal> values;     // and what they were last set to
+    bool stale = false;   // variables set since the files last ran
+    bool unsaved = false; // ran since the last save
+    int failed = 0;
+
+    CommandSession(ConfyState *st) : st(st) {}
+
+    void Update() {
+        if(!stale) return;
+        st->Update(0);
+        stale = false;
+        unsaved = true;
+    }
+
+    // number of files written, or -1; what is pending stays so if saving
+    // failed, to be tried again
+    int Commit() {
+        Update();
+        int n = st->SaveAll();
+        if(n<0) return -1;
+        overridden.clear();
+        values.clear();
+        unsaved = false;
+        return n;
+    }
+
+    // commit what is pending; false if that failed
+    bool Finish() {
+        return !(stale || unsaved) || Commit()>=0;
+    }
+
+    std::string Error(const char *fmt, ...) {
+        char buf[1024];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+        ++failed;
+        return std::string("error ")+buf;
+    }
+
+    // the reply to a command line, without the final newline; false for a
+    // blank line or comment
+    bool Handle(std::string_view line, std::string &reply) {
+        while(line.length() && isspace((unsigned char)line.back())) line.remove_suffix(1);
+        std::string_view cmd = batch_word(line);
+        if(cmd.empty() || cmd[0]=='#') return false;
+
+        if(cmd=="commit" || cmd=="save") {
+            int n = Commit();
+            if(n<0) reply = Error("save failed");
+            else reply = "ok "+std::to_string(n)+" written, "+std::to_string(st->files.size()-n)+" unchanged";
+            return true;
+        }
+        if(cmd=="list") {
+            Update();
+            std::string lines;
+            int n = 0;
+            for(int slot : st->varSlots) {
+                ConfyVar *var = st->Var(slot);
+                if(!var || var->hidden) continue;
+                lines += "\n";
+                lines += symbols.Name(slot);
+                lines += " ";
+                lines += var->val.Render();
+                ++n;
+            }
+            reply = "ok "+std::to_string(n)+lines;
+            return true;
+        }
+        if(cmd!="get" && cmd!="set" && cmd!="unset-override") {
+            reply = Error("unknown command '%.*s'", (int)cmd.length(), cmd.data());
+            return true;
+        }
+
+        std::string_view name = batch_word(line);
+        if(name.length() && name[0]=='$') name.remove_prefix(1);
+        int slot = symbols.Find(name);
+        ConfyVar *var = st->Var(slot);
+        if(!var) {
+            reply = Error("variable '%.*s' not found", (int)name.length(), name.data());
+            return true;
+        }
+
+        if(cmd=="get") {
+            Update();
+            if((var = st->Var(slot))) reply = "ok "+var->val.Render();
+            else reply = Error("variable '%.*s' not found", (int)name.length(), name.data());
+        } else if(cmd=="set") {
+            size_t b = line.find_first_not_of(" \t");
+            std::string text(b==std::string_view::npos ? std::string_view() : line.substr(b));
+            offs_t pos = 0;
+            ConfyVal newv;
+            Arena parsed; // until newv is kept by the state
+            if(!parseValue(text.c_str(), NULL, pos, newv, parsed)) {
+                reply = Error("couldn't parse value '%s'", text.c_str());
+                return true;
+            }
+            overridden.emplace(slot, var->val);
+            var->val.CoerceFrom(st->Keep(newv)); // coerce to definitional type
+            values[slot] = var->val;
+            st->exec.Edit(slot);
+            stale = true;
+            reply = "ok";
+        } else {
+            auto it = overridden.find(slot);
+            if(it!=overridden.end()) {
+                var->val = it->second;
+                st->exec.Edit(slot);
+                stale = true;
+                overridden.erase(it);
+                values.erase(slot);
+            }
+            reply = "ok";
+        }
+        return true;
+    }
+
+    // continue with fresh, a new load of the same files, with the sets not
+    // yet committed made again; those of variables it lacks are dropped
+    void Rebase(ConfyState *fresh) {
+        st = fresh;
+        overridden.clear();
+        for(auto it=values.begin(); it!=values.end(); ) {
+            ConfyVar *var = st->Var(it->first);
+            if(!var) {
+                it = values.erase(it);
+                continue;
+            }
+            overridden.emplace(it->first, var->val);
+            it->second = st->Keep(it->second); // the old state goes away
+            var->val.CoerceFrom(it->second);
+            st->exec.Edit(it->first);
+            ++it;
+        }
+        stale = !values.empty();
+        unsaved = false;
+    }
+};
+
+// returns nonzero if any command failed
+int batch(ConfyState &st, FILE *in) {
+    CommandSession s(&st);
+    std::string reply;
+    char *buf = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while((len = getline(&buf, &cap, in))>=0) {
+        if(!s.Handle(std::string_view(buf, len), reply)) continue;
+        puts(reply.c_str());
+        fflush(stdout); // for whoever drives this through a pipe
+    }
+    free(buf);
+    if(!s.Finish()) ++s.failed;
+    return s.failed;
+}
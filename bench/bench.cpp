@@ -0,0 +1,232 @@
+// benchmarks for the hot paths, built and run by `make bench`
+//
+//   bench/bench [<name>...]
+//
+// runs the named benchmarks, or all of them. Inputs are generated, so the
+// numbers can be compared between builds on the same machine; each time is
+// the best of a few runs
+
+#define main confy_main
+#include "../confy.cpp"
+#undef main
+
+// best time of reps runs of fn, in seconds
+static double best_of(int reps, const std::function<void()> &fn) {
+    double best = 1e30;
+    for(int r=0;r<reps;++r) {
+        double t0 = ConfyStats::Now();
+        fn();
+        best = std::min(best, ConfyStats::Now()-t0);
+    }
+    return best;
+}
+
+static volatile size_t sink; // keeps results the compiler could drop
+
+static void report(const char *what, size_t bytes, double secs) {
+    printf("  %-40s %9.1f MB/s\n", what, bytes/secs/1e6);
+}
+
+// colourBlocks on 32 MB of LaTeX-like text, with a metacode line and an
+// inert comment line in every `every` lines; compared with trying every
+// delimiter at every byte, as was done before the scanner
+static std::string latex_text(size_t size, int every) {
+    std::string s = "% confy-setup { line: \"%-\", meta_line: \"%!\", block_start: \"\\\\iffalse%-\", block_end: \"\\\\fi%-\" }\n";
+    for(int i=0; s.size()<size; ++i) {
+        if(i%every==0) s += "%! $x" + std::to_string(i) + " = 1;\n";
+        else if(i%every==1) s += "%- an inert comment line that is kept as it is\n";
+        else s += "Some running text in the document, with $math$ and \\emph{markup}.\n";
+    }
+    return s;
+}
+
+static size_t colour_naive(ConfyFile &f) {
+    const std::string *delims[] = { &f.setup.line, &f.setup.block_start, &f.setup.meta_line, &f.setup.meta_block_start };
+    size_t found = 0;
+    for(offs_t pos=f.setup_end; pos<f.size; ++pos)
+        for(auto d : delims)
+            if(d->length() && match_string(f.data, NULL, pos, d->c_str())) { ++found; break; }
+    return found;
+}
+
+static void bench_colour() {
+    printf("colourBlocks:\n");
+    for(int every : { 2, 20, 1000 }) {
+        std::string text = latex_text(32<<20, every);
+        ConfyFile f;
+        f.data = text.c_str();
+        f.size = text.size();
+        if(!f.parseSetup()) abort();
+        char what[64];
+        snprintf(what, sizeof(what), "scanner, metacode every %d lines", every);
+        report(what, text.size(), best_of(5, [&] { f.colourBlocks(); sink = f.segs.segs.size(); }));
+        snprintf(what, sizeof(what), "every delimiter at every byte");
+        report(what, text.size(), best_of(2, [&] { sink = colour_naive(f); }));
+    }
+}
+
+// the parser_utils.hpp scanning helpers against the std::function ones they
+// replaced, on 1 MB runs of whitespace, identifier and quoted-string bytes
+typedef std::function<bool (const char *, const char *, int)> OldPred;
+static int old_match_while(const char *s, const char *m, int pos, OldPred test) {
+    int d=0;
+    while(s[pos+d] && test(s,m,pos+d)) ++d;
+    return d;
+}
+
+static void bench_combinators() {
+    printf("parser combinators:\n");
+    const size_t n = 1<<20;
+    std::string ws(n, ' '), ident(n, 'a'), quoted(n, 'q');
+    for(size_t i=0;i<n;i+=7) { ws[i] = '\t'; ident[i] = '_'; quoted[i] = ' '; }
+
+    report("whitespace, std::function", n, best_of(20, [&] {
+        sink = old_match_while(ws.c_str(), NULL, 0, [] (const char *s, const char *, int p) {
+            char c=s[p]; return c==' ' || c=='\t' || c=='\r' || c=='\n'; });
+    }));
+    report("whitespace, template", n, best_of(20, [&] { sink = eat_whitespace(ws.c_str(), NULL, 0); }));
+
+    report("identifier, std::function", n, best_of(20, [&] {
+        sink = old_match_while(ident.c_str(), NULL, 0, [] (const char *s, const char *, int p) {
+            char c=s[p]; return (c>='a' && c<='z')||(c>='A' && c<='Z')||(c>='0'&&c<='9')||(c=='_'); });
+    }));
+    report("identifier, template", n, best_of(20, [&] {
+        offs_t pos = 0;
+        sink = capture_ident(ident.c_str(), NULL, &pos).length();
+    }));
+
+    report("quoted string, std::function", n, best_of(20, [&] {
+        sink = old_match_while(quoted.c_str(), NULL, 0, [] (const char *s, const char *, int p) {
+            char c=s[p]; return !(c=='\"' || c==0 || c=='\n'); });
+    }));
+    report("quoted string, template", n, best_of(20, [&] {
+        offs_t pos = 0;
+        sink = capture_while(quoted.c_str(), NULL, &pos, IsQuotedChar()).length();
+    }));
+}
+
+// a scratch directory for generated files, removed at exit
+static std::string scratch_dir() {
+    static std::string dir;
+    if(dir.empty()) {
+        const char *tmp = getenv("TMPDIR");
+        std::string templ = std::string(tmp && *tmp ? tmp : "/tmp") + "/confy-bench.XXXXXX";
+        if(!mkdtemp(&templ[0])) abort();
+        dir = templ;
+        atexit([] { std::error_code ec; std::filesystem::remove_all(dir, ec); });
+    }
+    return dir;
+}
+
+static void write_file(const std::string &fname, const std::string &text) {
+    FILE *fl = fopen(fname.c_str(), "wb");
+    if(!fl || fwrite(text.data(), 1, text.size(), fl)!=text.size() || fclose(fl)) abort();
+}
+
+// condition of the given depth mixing && and || over comparisons
+static std::string condition(int depth, unsigned &seed) {
+    seed = seed*1103515245+12345;
+    if(!depth) {
+        int a = seed>>16&7, b = seed>>20&7, k = seed>>24&3;
+        return "$v"+std::to_string(a)+" + "+std::to_string(k)+" > $v"+std::to_string(b);
+    }
+    const char *op = seed>>16&1 ? " && " : " || ";
+    return "("+condition(depth-1, seed)+op+condition(depth-1, seed)+")";
+}
+
+// running 200 if statements with depth-5 && and || conditions, with the
+// tree evaluator and with the bytecode
+static void bench_eval() {
+    printf("expression evaluation:\n");
+    std::string text = "// confy-setup { line: \"//-\", meta_line: \"//!\" }\n";
+    for(int i=0;i<8;++i) text += "//! int $v"+std::to_string(i)+" = "+std::to_string(i*3%8)+";\n";
+    text += "//! hidden int $n = 0;\n";
+    unsigned seed = 1;
+    for(int i=0;i<200;++i)
+        text += "//! if("+condition(5, seed)+") {\n//!   $n = $n + 1;\n//! }\n";
+    std::string fname = scratch_dir()+"/eval.txt";
+    write_file(fname, text);
+
+    ConfyState st;
+    if(!st.LoadAndParseFile(fname)) abort();
+    exec_incremental = false;
+    for(auto [mode, what] : { std::pair(EVAL_TREE, "tree evaluator"), std::pair(EVAL_VM, "bytecode") }) {
+        eval_mode = mode;
+        double secs = best_of(20, [&] { st.Execute(0); });
+        printf("  %-40s %9.3f ms per run\n", what, secs*1e3);
+    }
+    exec_incremental = true;
+    eval_mode = EVAL_VM;
+}
+
+// loading and saving a tree of 10k small files in the scratch directory,
+// one by one and in batches, with io_uring and with plain system calls.
+// Saves are synced; set TMPDIR to put the files on tmpfs or on a disk
+static void bench_files() {
+    printf("10k files in %s:\n", scratch_dir().c_str());
+    std::vector<std::string> names;
+    std::string text(300, 'x');
+    for(int i=0;i<10000;++i) {
+        std::string dir = scratch_dir()+"/files/"+std::to_string(i/100);
+        if(i%100==0) std::filesystem::create_directories(dir);
+        names.push_back(dir+"/f"+std::to_string(i)+".txt");
+        write_file(names.back(), text);
+    }
+    auto fill = [&] (Sink &w) { w.Write(text); };
+    WorkPool pool(1);
+
+    for(bool uring : { true, false }) {
+        io_uring_enabled = uring;
+        const char *how = uring ? "io_uring" : "plain calls";
+        char what[64];
+        snprintf(what, sizeof(what), "load one by one, %s", how);
+        double secs = best_of(3, [&] {
+            std::vector<FileBuffer> bufs(names.size());
+            for(size_t i=0;i<names.size();++i) LoadFileBuffer(names[i], &bufs[i]);
+        });
+        printf("  %-40s %9.3f s\n", what, secs);
+        snprintf(what, sizeof(what), "load batched, %s", how);
+        secs = best_of(3, [&] {
+            std::vector<FileBuffer> bufs;
+            LoadFileBuffers(names, bufs);
+        });
+        printf("  %-40s %9.3f s\n", what, secs);
+
+        snprintf(what, sizeof(what), "save one by one, %s", how);
+        secs = best_of(3, [&] {
+            std::vector<Replacement> rs(names.size());
+            for(size_t i=0;i<names.size();++i)
+                if(!WriteReplacement(names[i], NULL, fill, rs[i])) abort();
+            if(!CommitReplacements(rs, {}, &pool)) abort();
+        });
+        printf("  %-40s %9.3f s\n", what, secs);
+        snprintf(what, sizeof(what), "save batched, %s", how);
+        secs = best_of(3, [&] {
+            std::vector<Replacement> rs;
+            if(!WriteReplacements(names, [&] (size_t, Sink &w) { fill(w); }, rs, &pool)) abort();
+            if(!CommitReplacements(rs, {}, &pool)) abort();
+        });
+        printf("  %-40s %9.3f s\n", what, secs);
+    }
+    io_uring_enabled = true;
+}
+
+static const struct {
+    const char *name;
+    void (*run)();
+} benches[] = {
+    { "colour", bench_colour },
+    { "combinators", bench_combinators },
+    { "eval", bench_eval },
+    { "files", bench_files },
+};
+
+int main(int argc, char **argv) {
+    cache_enabled = false;
+    for(auto &b : benches) {
+        bool want = argc<2;
+        for(int i=1;i<argc;++i) want = want || !strcmp(argv[i], b.name);
+        if(want) b.run();
+    }
+    return 0;
+}
@@ -0,0 +1,219 @@
+// expressions compiled to register bytecode at parse time
+//
+// Each ExprNode gets a flat instruction list working on a small register file.
+// Operators whose left operand has a type known at compile time (literals and
+// results of other operators) get typed opcodes, the rest check the type tag
+// at run time like the tree evaluator does. '&&' and '||' short-circuit. The
+// tree evaluator is kept, selected with --tree-eval, and --check-eval runs
+// both and reports any difference.
+
+enum { EVAL_VM, EVAL_TREE, EVAL_CHECK } eval_mode = EVAL_VM;
+
+enum OpCode : uint8_t {
+    OP_RET,     // return dst
+    OP_LOADK,   // dst = consts[a]
+    OP_LOADVAR, // dst = value of the variable in slot a, or false
+    OP_JT,      // if dst is true goto a
+    OP_JF,      // if dst is false goto a
+    OP_TOBOOL,  // dst = bool(dst)
+    OP_NOT,     // dst = !a
+    OP_NEG, OP_NEG_I, OP_NEG_F, // dst = -a
+    OP_EQ, OP_NE, // dst = a == b, compared as the type of a
+    // dst = a <op> b; plain versions go by the type of a at run time, _I and _F
+    // versions are picked when a is known to be a non-float or a float
+    OP_LE, OP_LE_I, OP_LE_F,
+    OP_LT, OP_LT_I, OP_LT_F,
+    OP_GE, OP_GE_I, OP_GE_F,
+    OP_GT, OP_GT_I, OP_GT_F,
+    OP_ADD, OP_ADD_I, OP_ADD_F,
+    OP_SUB, OP_SUB_I, OP_SUB_F,
+    OP_MUL, OP_MUL_I, OP_MUL_F,
+    OP_DIV, OP_DIV_I, OP_DIV_F,
+    OP_MOD
+};
+
+struct Insn {
+    OpCode op;
+    uint16_t dst, a, b;
+};
+
+struct ExprCode {
+    std::vector<Insn> code;
+    std::vector<ConfyVal> consts;
+    int nregs = 0;
+
+    ConfyVal Run(ConfyState *st) const;
+};
+
+// static type of a compiled subexpression, or T_UNKNOWN
+static const int T_UNKNOWN = -1;
+
+struct ExprCompiler {
+    ExprCode &out;
+    bool ok = true; // false if the expression doesn't fit the instruction format
+
+    int emit(OpCode op, int dst, int a=0, int b=0) {
+        if(dst>0xffff || a>0xffff || b>0xffff || out.code.size()>=0xffff) ok = false;
+        if(dst+1>out.nregs) out.nregs = dst+1;
+        out.code.push_back(Insn { op, (uint16_t)dst, (uint16_t)a, (uint16_t)b });
+        return out.code.size()-1;
+    }
+    void patch(int at) {
+        out.code[at].a = out.code.size();
+    }
+    // typed variant of a generic binary opcode, which is followed by _I and _F
+    static OpCode typed(OpCode op, int ltype) {
+        if(ltype==T_FLOAT) return (OpCode)(op+2);
+        if(ltype!=T_UNKNOWN) return (OpCode)(op+1);
+        return op;
+    }
+};
+
+int ExprVar::Compile(ExprCompiler &c, int dst) {
+    c.emit(OP_LOADVAR, dst, slot);
+    return T_UNKNOWN;
+}
+
+int ExprLiteral::Compile(ExprCompiler &c, int dst) {
+    c.out.consts.push_back(v);
+    c.emit(OP_LOADK, dst, c.out.consts.size()-1);
+    return v.t;
+}
+
+int ExprOp::Compile(ExprCompiler &c, int dst) {
+    int type = subexprs[0]->Compile(c, dst);
+    TokKind first = opTiers[tier].toks[subtypes[1]];
+
+    if(first==TK_OROR || first==TK_ANDAND) {
+        // a || b || c: stop at the first true operand, the result is bool(last one looked at)
+        std::vector<int> exits;
+        for(int i=1;i<subexprs.size();++i) {
+            exits.push_back(c.emit(first==TK_OROR ? OP_JT : OP_JF, dst));
+            subexprs[i]->Compile(c, dst);
+        }
+        for(int at : exits) c.patch(at);
+        c.emit(OP_TOBOOL, dst);
+        return T_BOOL;
+    }
+
+    for(int i=1;i<subexprs.size();++i) {
+        subexprs[i]->Compile(c, dst+1);
+        switch(opTiers[tier].toks[subtypes[i]]) {
+        case TK_EQ: c.emit(OP_EQ, dst, dst, dst+1); type = T_BOOL; break;
+        case TK_NE: c.emit(OP_NE, dst, dst, dst+1); type = T_BOOL; break;
+        case TK_LE: c.emit(c.typed(OP_LE, type), dst, dst, dst+1); type = T_BOOL; break;
+        case TK_LT: c.emit(c.typed(OP_LT, type), dst, dst, dst+1); type = T_BOOL; break;
+        case TK_GE: c.emit(c.typed(OP_GE, type), dst, dst, dst+1); type = T_BOOL; break;
+        case TK_GT: c.emit(c.typed(OP_GT, type), dst, dst, dst+1); type = T_BOOL; break;
+        case TK_PLUS: c.emit(c.typed(OP_ADD, type), dst, dst, dst+1); if(type!=T_UNKNOWN && type!=T_FLOAT) type = T_INT; break;
+        case TK_MINUS: c.emit(c.typed(OP_SUB, type), dst, dst, dst+1); if(type!=T_UNKNOWN && type!=T_FLOAT) type = T_INT; break;
+        case TK_STAR: c.emit(c.typed(OP_MUL, type), dst, dst, dst+1); if(type!=T_UNKNOWN && type!=T_FLOAT) type = T_INT; break;
+        case TK_SLASH: c.emit(c.typed(OP_DIV, type), dst, dst, dst+1); if(type!=T_UNKNOWN && type!=T_FLOAT) type = T_INT; break;
+        case TK_PERCENT: c.emit(OP_MOD, dst, dst, dst+1); type = T_INT; break;
+        default: c.ok = false;
+        }
+    }
+    return type;
+}
+
+int ExprNot::Compile(ExprCompiler &c, int dst) {
+    sub->Compile(c, dst);
+    c.emit(OP_NOT, dst, dst);
+    return T_BOOL;
+}
+
+int ExprNeg::Compile(ExprCompiler &c, int dst) {
+    int type = sub->Compile(c, dst);
+    if(type==T_FLOAT) c.emit(OP_NEG_F, dst, dst);
+    else if(type!=T_UNKNOWN) { c.emit(OP_NEG_I, dst, dst); type = T_INT; }
+    else c.emit(OP_NEG, dst, dst);
+    return type;
+}
+
+int ExprEq::Compile(ExprCompiler &c, int dst) {
+    left->Compile(c, dst);
+    right->Compile(c, dst+1);
+    c.emit(OP_EQ, dst, dst, dst+1);
+    return T_BOOL;
+}
+
+// expressions too large for the instruction format stay with the tree evaluator
+void ExprNode::Compile(Arena &arena) {
+    ExprCode *ec = arena.make<ExprCode>();
+    ExprCompiler c { *ec };
+    root->Compile(c, 0);
+    c.emit(OP_RET, 0);
+    code = c.ok ? ec : NULL;
+}
+
+static bool eq_val(const ConfyVal &l, const ConfyVal &r) {
+    switch(l.t) {
+    case T_BOOL: return l.AsBool() == r.AsBool();
+    case T_INT: return l.AsInt() == r.AsInt();
+    case T_FLOAT: return l.AsFloat() == r.AsFloat();
+    case T_STRING: return l.TextEquals(r);
+    default: return false;
+    }
+}
+
+ConfyVal ExprCode::Run(ConfyState *st) const {
+    // registers live in this frame, so that runs may nest or go on in
+    // several threads; only unusually deep expressions need the heap
+    ConfyVal local[32];
+    std::vector<ConfyVal> heap;
+    ConfyVal *regs = local;
+    if(nregs>32) {
+        heap.resize(nregs);
+        regs = heap.data();
+    }
+
+    #define BINARY_OP(OP, expr_i, expr_f) \
+        case OP: { const ConfyVal &a=regs[in.a], &b=regs[in.b]; \
+                   if(a.t==T_FLOAT) regs[in.dst]=expr_f; else regs[in.dst]=expr_i; break; } \
+        case OP##_I: { const ConfyVal &a=regs[in.a], &b=regs[in.b]; regs[in.dst]=expr_i; break; } \
+        case OP##_F: { const ConfyVal &a=regs[in.a], &b=regs[in.b]; regs[in.dst]=expr_f; break; }
+
+    for(size_t pc=0;;) {
+        const Insn &in = code[pc++];
+        switch(in.op) {
+        case OP_RET: return regs[in.dst];
+        case OP_LOADK: regs[in.dst] = consts[in.a]; break;
+        case OP_LOADVAR: {
+            st->exec.Read(in.a);
+            ConfyVar *var = st->Var(in.a);
+            regs[in.dst] = var ? var->val : boolVal(false);
+            break;
+        }
+        case OP_JT: if(regs[in.dst].AsBool()) pc = in.a; break;
+        case OP_JF: if(!regs[in.dst].AsBool()) pc = in.a; break;
+        case OP_TOBOOL: regs[in.dst] = boolVal(regs[in.dst].AsBool()); break;
+        case OP_NOT: regs[in.dst] = boolVal(!regs[in.a].AsBool()); break;
+        case OP_NEG: regs[in.dst] = regs[in.a].t==T_FLOAT ? floatVal(-regs[in.a].AsFloat()) : intVal(-regs[in.a].AsInt()); break;
+        case OP_NEG_I: regs[in.dst] = intVal(-regs[in.a].AsInt()); break;
+        case OP_NEG_F: regs[in.dst] = floatVal(-regs[in.a].AsFloat()); break;
+        case OP_EQ: regs[in.dst] = boolVal(eq_val(regs[in.a], regs[in.b])); break;
+        case OP_NE: regs[in.dst] = boolVal(!eq_val(regs[in.a], regs[in.b])); break;
+        BINARY_OP(OP_LE, boolVal(a.AsInt()<=b.AsInt()), boolVal(a.AsFloat()<=b.AsFloat()))
+        BINARY_OP(OP_LT, boolVal(a.AsInt()<b.AsInt()), boolVal(a.AsFloat()<b.AsFloat()))
+        BINARY_OP(OP_GE, boolVal(a.AsInt()>=b.AsInt()), boolVal(a.AsFloat()>=b.AsFloat()))
+        BINARY_OP(OP_GT, boolVal(a.AsInt()>b.AsInt()), boolVal(a.AsFloat()>b.AsFloat()))
+        BINARY_OP(OP_ADD, intVal(a.AsInt()+b.AsInt()), floatVal(a.AsFloat()+b.AsFloat()))
+        BINARY_OP(OP_SUB, intVal(a.AsInt()-b.AsInt()), floatVal(a.AsFloat()-b.AsFloat()))
+        BINARY_OP(OP_MUL, intVal(a.AsInt()*b.AsInt()), floatVal(a.AsFloat()*b.AsFloat()))
+        BINARY_OP(OP_DIV, intVal(a.AsInt()/b.AsInt()), floatVal(a.AsFloat()/b.AsFloat()))
+        case OP_MOD: regs[in.dst] = intVal(regs[in.a].AsInt()%regs[in.b].AsInt()); break;
+        }
+    }
+    #undef BINARY_OP
+}
+
+ConfyVal ExprNode::Execute(int fid, ConfyState *st, bool enable) {
+    if(!code || eval_mode==EVAL_TREE) return root->Eval(fid,st);
+    if(eval_mode==EVAL_VM) return code->Run(st);
+
+    ConfyVal tv = root->Eval(fid,st), cv = code->Run(st);
+    if(!tv.Same(cv))
+        fprintf(stderr, "EVAL MISMATCH in '%.*s': tree %s, bytecode %s\n", (int)source.length(), source.data(),
+                tv.Render().c_str(), cv.Render().c_str());
+    return tv;
+}
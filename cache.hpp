@@ -0,0 +1,479 @@
+// on-disk cache of parse results, so that unchanged files skip parseSetup,
+// colourBlocks and parseBody on startup
+//
+// One cache file per source file, named after a hash of its canonical path and
+// kept in $XDG_CACHE_HOME/confy (or ~/.cache/confy). It holds the setup block,
+// the segment table and the AST as parsed, before any execution, and is only
+// used if the size, mtime and content hash of the source still match. Views
+// into the file buffer are stored as offsets. Anything that doesn't check out
+// is treated as a miss and the file is parsed normally.
+
+static const uint32_t CACHE_MAGIC = 0x79666e63; // "cnfy"
+static const uint32_t CACHE_VERSION = 5;
+
+bool cache_enabled = true;
+
+enum CacheTag : uint8_t {
+    N_NULL=0,
+    N_SEQ, N_SOURCEBLOCK, N_IFTHEN, N_IFTHENELSE, N_TEMPLATE, N_INCLUDE,
+    N_EXPRNODE, N_VARDEF, N_VARASSIGN,
+    N_EXPRVAR, N_EXPRLITERAL, N_EXPROP, N_EXPRNOT, N_EXPRNEG, N_EXPREQ
+};
+
+struct CacheWriter {
+    std::string out;
+    const char *base; // file buffer that views are relative to
+    size_t size;
+
+    template<typename T> void put(T v) {
+        out.append((const char*)&v, sizeof(T));
+    }
+    void str(std::string_view sv) {
+        put<uint32_t>(sv.length());
+        out.append(sv.data(), sv.length());
+    }
+    void view(std::string_view sv) {
+        if(sv.data()>=base && sv.data()+sv.length()<=base+size) {
+            put<uint8_t>(0);
+            put<uint64_t>(sv.data()-base);
+            put<uint64_t>(sv.length());
+        } else {
+            // literal text that was not taken from the file
+            put<uint8_t>(1);
+            str(sv);
+        }
+    }
+    void val(const ConfyVal &v) {
+        put<uint8_t>(v.t);
+        put<uint8_t>(v.k);
+        switch(v.k) {
+        case K_BOOL: put<uint8_t>(v.b); break;
+        case K_INT: put<int32_t>(v.i); break;
+        case K_FLOAT: put<double>(v.f); break;
+        case K_LITERAL: put<double>(v.Literal()); str(v.Str()); break;
+        default: str(v.Str());
+        }
+    }
+    void node(SyntaxNode *n) {
+        if(n) n->Save(*this);
+        else put<uint8_t>(N_NULL);
+    }
+    void expr(Expr *e) {
+        if(e) e->Save(*this);
+        else put<uint8_t>(N_NULL);
+    }
+};
+
+// all reads are bounds checked; on malformed input bad is set and zeroes are
+// returned from then on, the caller discards whatever was built
+struct CacheReader {
+    const char *p, *end;
+    const char *base;
+    size_t size;
+    Arena *arena;
+    std::vector<std::string> *includes; // file names of Include nodes read
+    bool bad = false;
+    int depth = 0;
+
+    template<typename T> T get() {
+        T v {};
+        if(bad || end-p < (ptrdiff_t)sizeof(T)) { bad = true; return v; }
+        memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+        return v;
+    }
+    std::string_view raw() {
+        uint32_t len = get<uint32_t>();
+        if(bad || end-p < (ptrdiff_t)len) { bad = true; return std::string_view(); }
+        std::string_view sv(p, len);
+        p += len;
+        return sv;
+    }
+    std::string str() {
+        return std::string(raw());
+    }
+    std::string_view view() {
+        uint8_t kind = get<uint8_t>();
+        if(kind==1) return arena->copy(raw());
+        uint64_t off = get<uint64_t>(), len = get<uint64_t>();
+        if(kind!=0 || off>size || len>size-off) { bad = true; return std::string_view(); }
+        return std::string_view(base+off, len);
+    }
+    ConfyVal val() {
+        uint8_t t = get<uint8_t>(), k = get<uint8_t>();
+        ConfyVal v;
+        switch(k) {
+        case K_BOOL: v = boolVal(get<uint8_t>()); break;
+        case K_INT: v = intVal(get<int32_t>()); break;
+        case K_FLOAT: v = floatVal(get<double>()); break;
+        case K_LITERAL: {
+            double f = get<double>();
+            v = litVal(raw(), f, *arena);
+            break;
+        }
+        case K_STRING: v = strVal(arena->copy(raw())); break;
+        default: bad = true; return ConfyVal();
+        }
+        if(t>T_STRING) bad = true;
+        else v.t = (ConfyType)t;
+        return v;
+    }
+    // element count of a list, each element taking at least one byte
+    uint32_t count() {
+        uint32_t n = get<uint32_t>();
+        if(n > (size_t)(end-p)) { bad = true; return 0; }
+        return n;
+    }
+
+    template<typename T> T *make() {
+        T *n = arena->make<T>();
+        ++depth;
+        n->Load(*this);
+        --depth;
+        return n;
+    }
+    // the parser makes no null children, and the nodes rely on that, so an
+    // N_NULL where a node or expression is read is malformed input too
+    SyntaxNode *node();
+    Expr *expr();
+};
+
+SyntaxNode *CacheReader::node() {
+    if(depth>10000) bad = true;
+    switch(get<uint8_t>()) {
+    case N_SEQ: return make<Seq>();
+    case N_SOURCEBLOCK: return make<SourceBlock>();
+    case N_IFTHEN: return make<IfThen>();
+    case N_IFTHENELSE: return make<IfThenElse>();
+    case N_TEMPLATE: return make<Template>();
+    case N_INCLUDE: return make<Include>();
+    case N_EXPRNODE: return make<ExprNode>();
+    case N_VARDEF: return make<VarDef>();
+    case N_VARASSIGN: return make<VarAssign>();
+    default: bad = true; return NULL;
+    }
+}
+
+Expr *CacheReader::expr() {
+    if(depth>10000) bad = true;
+    switch(get<uint8_t>()) {
+    case N_EXPRVAR: return make<ExprVar>();
+    case N_EXPRLITERAL: return make<ExprLiteral>();
+    case N_EXPROP: return make<ExprOp>();
+    case N_EXPRNOT: return make<ExprNot>();
+    case N_EXPRNEG: return make<ExprNeg>();
+    case N_EXPREQ: return make<ExprEq>();
+    default: bad = true; return NULL;
+    }
+}
+
+void Seq::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_SEQ);
+    w.put<uint32_t>(children.size());
+    for(auto n : children) w.node(n);
+}
+void Seq::Load(CacheReader &r) {
+    uint32_t n = r.count();
+    for(uint32_t i=0;i<n && !r.bad;++i) children.push_back(r.node());
+    for(auto c : children) if(c) c->parent = this;
+}
+
+void SourceBlock::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_SOURCEBLOCK);
+    w.put<uint8_t>(bType);
+    w.view(contents);
+}
+void SourceBlock::Load(CacheReader &r) {
+    uint8_t t = r.get<uint8_t>();
+    if(t>B_META_CHAFF) { r.bad = true; t = B_META_CHAFF; }
+    bType = (decltype(bType))t;
+    contents = r.view();
+}
+
+void IfThen::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_IFTHEN);
+    w.view(pre); w.view(post);
+    w.node(cond); w.node(sub);
+}
+void IfThen::Load(CacheReader &r) {
+    pre = r.view(); post = r.view();
+    cond = r.node(); sub = r.node();
+    if(sub) sub->parent = this;
+}
+
+void IfThenElse::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_IFTHENELSE);
+    w.view(pre); w.view(inter); w.view(post);
+    w.node(cond); w.node(sub1); w.node(sub2);
+}
+void IfThenElse::Load(CacheReader &r) {
+    pre = r.view(); inter = r.view(); post = r.view();
+    cond = r.node(); sub1 = r.node(); sub2 = r.node();
+    if(sub1) sub1->parent = this;
+    if(sub2) sub2->parent = this;
+}
+
+void Template::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_TEMPLATE);
+    w.view(pre); w.view(inter); w.view(post);
+    w.node(temp);
+}
+void Template::Load(CacheReader &r) {
+    pre = r.view(); inter = r.view(); post = r.view();
+    temp = r.node();
+    if(temp) temp->parent = this;
+    if(!r.bad && temp) Compile();
+}
+
+void Include::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_INCLUDE);
+    w.view(source);
+    w.str(fname);
+}
+void Include::Load(CacheReader &r) {
+    source = r.view();
+    fname = r.str();
+    r.includes->push_back(fname);
+}
+
+void ExprNode::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_EXPRNODE);
+    w.view(source);
+    w.expr(root);
+}
+void ExprNode::Load(CacheReader &r) {
+    source = r.view();
+    root = r.expr();
+    if(!r.bad) Compile(*r.arena);
+}
+
+void VarDef::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_VARDEF);
+    w.view(pre); w.view(post);
+    w.str(name);
+    w.put<uint8_t>(hidden);
+    w.str(v.display);
+    w.val(v.val);
+}
+void VarDef::Load(CacheReader &r) {
+    pre = r.view(); post = r.view();
+    name = r.str();
+    slot = symbols.Slot(name);
+    hidden = r.get<uint8_t>();
+    v.display = r.str();
+    v.val = r.val();
+}
+
+void VarAssign::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_VARASSIGN);
+    w.view(source);
+    w.str(varname);
+    w.node(expr);
+}
+void VarAssign::Load(CacheReader &r) {
+    source = r.view();
+    varname = r.str();
+    slot = symbols.Slot(varname);
+    expr = r.node();
+}
+
+void ExprVar::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_EXPRVAR);
+    w.str(name);
+}
+void ExprVar::Load(CacheReader &r) {
+    name = r.str();
+    slot = symbols.Slot(name);
+}
+
+void ExprLiteral::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_EXPRLITERAL);
+    w.val(v);
+}
+void ExprLiteral::Load(CacheReader &r) {
+    v = r.val();
+}
+
+void ExprOp::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_EXPROP);
+    w.put<uint8_t>(tier);
+    w.put<uint32_t>(subexprs.size());
+    for(int i=0;i<subexprs.size();++i) {
+        w.put<uint8_t>(subtypes[i]);
+        w.expr(subexprs[i]);
+    }
+}
+void ExprOp::Load(CacheReader &r) {
+    tier = r.get<uint8_t>();
+    if(tier >= sizeof(opTiers)/sizeof(opTiers[0]) || !opTiers[tier].ops.size()) { r.bad = true; return; }
+    op = opTiers[tier].ev_fun;
+    uint32_t n = r.count();
+    for(uint32_t i=0;i<n && !r.bad;++i) {
+        uint8_t t = r.get<uint8_t>();
+        if(t >= opTiers[tier].toks.size()) { r.bad = true; t = 0; }
+        subtypes.push_back(t);
+        subexprs.push_back(r.expr());
+    }
+    if(n<2) r.bad = true;
+}
+
+void ExprNot::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_EXPRNOT);
+    w.expr(sub);
+}
+void ExprNot::Load(CacheReader &r) {
+    sub = r.expr();
+}
+
+void ExprNeg::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_EXPRNEG);
+    w.expr(sub);
+}
+void ExprNeg::Load(CacheReader &r) {
+    sub = r.expr();
+}
+
+void ExprEq::Save(CacheWriter &w) {
+    w.put<uint8_t>(N_EXPREQ);
+    w.expr(left); w.expr(right);
+}
+void ExprEq::Load(CacheReader &r) {
+    left = r.expr(); right = r.expr();
+}
+
+// cache file for fname, or "" if there is nowhere to keep one
+static std::string cache_path(const std::string &fname) {
+    std::string dir;
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if(xdg && *xdg) dir = std::string(xdg) + "/confy";
+    else if(home && *home) dir = std::string(home) + "/.cache/confy";
+    else return "";
+
+    std::error_code ec;
+    auto canon = std::filesystem::canonical(fname, ec);
+    if(ec) return "";
+    std::string key = canon.string();
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)hash_bytes(key.data(), key.length()));
+    return dir + name;
+}
+
+struct CacheHeader {
+    uint32_t magic, version;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t hash;         // of the source contents
+    uint64_t payload_hash; // of everything after the header
+};
+
+static CacheHeader cache_header(const ConfyFile &f) {
+    return CacheHeader { CACHE_MAGIC, CACHE_VERSION, f.buf.size, f.buf.mtime_ns, hash_buffer(f.buf), 0 };
+}
+
+// fill in f's parse results from the cache; false on any kind of miss, with f
+// left as it was
+bool LoadParseCache(ConfyFile &f) {
+    if(!cache_enabled || !f.buf.regular) return false;
+    std::string path = cache_path(f.fname);
+    if(!path.length()) return false;
+
+    FileBuffer cbuf;
+    int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+    if(fd<0) return false;
+    struct stat sb;
+    bool ok = !fstat(fd, &sb) && S_ISREG(sb.st_mode) && sb.st_size>=(off_t)sizeof(CacheHeader)
+              && map_file(fd, sb.st_size, &cbuf);
+    close(fd);
+    if(!ok) return false;
+
+    CacheReader r { cbuf.data, cbuf.data+cbuf.size, f.data, (size_t)f.size, &f.arena, &f.includes };
+    CacheHeader h = r.get<CacheHeader>();
+    // cheap checks first, the content hash reads the whole file
+    if(h.magic!=CACHE_MAGIC || h.version!=CACHE_VERSION || h.size!=f.buf.size || h.mtime_ns!=f.buf.mtime_ns)
+        return false;
+    if(h.hash!=hash_buffer(f.buf) || h.payload_hash!=hash_bytes(r.p, r.end-r.p)) return false;
+
+    f.setup.line = r.str();
+    f.setup.block_start = r.str();
+    f.setup.block_end = r.str();
+    f.setup.meta_line = r.str();
+    f.setup.meta_block_start = r.str();
+    f.setup.meta_block_end = r.str();
+    f.setup_start = r.get<int64_t>();
+    f.setup_end = r.get<int64_t>();
+
+    SegMap segs;
+    uint32_t n = r.count();
+    for(uint32_t i=0;i<n && !r.bad;++i) {
+        Segment sg;
+        sg.start = r.get<int64_t>();
+        sg.len = r.get<int64_t>();
+        uint8_t kind = r.get<uint8_t>();
+        if(kind>(uint8_t)Mask::M_PROTECTED || sg.start<0 || sg.len<0 || sg.start>f.size-sg.len) {
+            r.bad = true;
+            kind = (uint8_t)Mask::M_PROTECTED;
+        }
+        sg.kind = (Mask)kind;
+        segs.segs.push_back(sg);
+    }
+
+    f.s = r.node();
+    if(r.bad || r.p!=r.end || !f.s) {
+        f.arena.Clear();
+        f.s = NULL;
+        f.setup = {};
+        f.includes.clear();
+        return false;
+    }
+    f.segs = std::move(segs);
+    return true;
+}
+
+// store f's freshly parsed, not yet executed, AST; failures are ignored
+bool StoreParseCache(ConfyFile &f) {
+    if(!cache_enabled || !f.buf.regular) return false;
+    std::string path = cache_path(f.fname);
+    if(!path.length()) return false;
+
+    CacheWriter w { std::string(), f.data, (size_t)f.size };
+    w.put(CacheHeader {}); // filled in last
+    w.str(f.setup.line);
+    w.str(f.setup.block_start);
+    w.str(f.setup.block_end);
+    w.str(f.setup.meta_line);
+    w.str(f.setup.meta_block_start);
+    w.str(f.setup.meta_block_end);
+    w.put<int64_t>(f.setup_start);
+    w.put<int64_t>(f.setup_end);
+    w.put<uint32_t>(f.segs.segs.size());
+    for(auto &sg : f.segs.segs) {
+        w.put<int64_t>(sg.start);
+        w.put<int64_t>(sg.len);
+        w.put<uint8_t>((uint8_t)sg.kind);
+    }
+    w.node(f.s);
+    CacheHeader h = cache_header(f);
+    h.payload_hash = hash_bytes(w.out.data()+sizeof(h), w.out.length()-sizeof(h));
+    memcpy(&w.out[0], &h, sizeof(h));
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+    if(ec) return false;
+    // write then rename, so a concurrent reader never sees a partial file
+    std::string tmp;
+    int fd = open_tmp(path, 0644, tmp);
+    if(fd<0) return false;
+    bool ok = true;
+    for(size_t done=0; ok && done<w.out.length(); ) {
+        ssize_t n = write(fd, w.out.data()+done, w.out.length()-done);
+        if(n<0 && errno==EINTR) continue;
+        if(n<=0) ok = false;
+        else done += n;
+    }
+    ok = !close(fd) && ok;
+    if(!ok || rename(tmp.c_str(), path.c_str())) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
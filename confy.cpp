@@ -1,12 +1,22 @@
 #include <string>
+#include <string_view>
 #include <vector>
 #include <filesystem>
 #include <map>
+#include <set>
 #include <functional>
+#include <chrono>
+#include <charconv>
+#include <unordered_set>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <malloc.h>
 #include <string.h>
+#include <limits.h>
 
 enum class Mask : char {
     M_META=0,
@@ -23,124 +33,389 @@ enum class Mask : char {
 
 struct ConfyFile;
 
-enum ConfyType {
+enum ConfyType : uint8_t {
     T_BOOL,
     T_INT,
     T_FLOAT,
     T_STRING
 };
 
-struct ConfyVal {
-    ConfyType t;
-    bool b;
-    int i;
-    double f;
-    std::string s;
+// what a value was made from. Its bool, int, float and textual views all
+// follow from that; a value converted to another type keeps them and only
+// changes t, so that an int set from true still reads as "true"
+enum ValKind : uint8_t {
+    K_BOOL,
+    K_INT,
+    K_FLOAT,   // computed, written as "%f"
+    K_LITERAL, // number as written in the source; its value and text are kept
+    K_STRING
+};
+
+// 16-byte tagged value: a bool, int, double, or a text of up to 13 bytes
+// stored inline. Longer texts, and literals, which are their double followed
+// by their text, are views, so that values stay trivially copyable; they
+// belong to the arena of the file the value was parsed from, or to the
+// ConfyState for values set from outside (see keep_text and ConfyState::Keep)
+struct alignas(8) ConfyVal {
+    static const int SHORT = 13;
+    static const uint8_t LONG = 0xff;
+
+    union {
+        bool b;
+        int i;
+        double f;
+        struct {
+            const char *p;
+            uint32_t n;
+        } __attribute__((packed)) lt; // K_STRING with len==LONG, and K_LITERAL
+        char ss[SHORT];               // K_STRING, len<=SHORT
+    } __attribute__((packed));
+    uint8_t len;
+    ValKind k = K_BOOL;
+    ConfyType t = T_BOOL;
+
+    ConfyVal() : f(0.0), len(0) {}
+
+    // value of a K_LITERAL, parsed when it was made
+    double Literal() const {
+        double d;
+        memcpy(&d, lt.p, sizeof(d));
+        return d;
+    }
 
-    std::string Render() {
-        char buf[64];
+    bool AsBool() const {
+        switch(k) {
+        case K_BOOL: return b;
+        case K_INT: return i!=0;
+        case K_FLOAT: return ((int)f)!=0;
+        case K_LITERAL: return ((int)Literal())!=0;
+        default: return Str().length();
+        }
+    }
+    int AsInt() const {
+        switch(k) {
+        case K_BOOL: return b;
+        case K_INT: return i;
+        case K_FLOAT: return (int)f;
+        case K_LITERAL: return (int)Literal();
+        default: return Str().length() ? 1 : 0;
+        }
+    }
+    double AsFloat() const {
+        switch(k) {
+        case K_BOOL: return b;
+        case K_INT: return i;
+        case K_FLOAT: return f;
+        case K_LITERAL: return Literal();
+        default: return Str().length() ? 1.0 : 0.0;
+        }
+    }
+    // contents of a K_STRING, or text of a K_LITERAL
+    std::string_view Str() const {
+        if(k==K_LITERAL) return std::string_view(lt.p+sizeof(double), lt.n-sizeof(double));
+        if(len==LONG) return std::string_view(lt.p, lt.n);
+        return std::string_view(ss, len);
+    }
+    // what a value with len==LONG refers to, to be copied elsewhere and
+    // referred to there with Refer
+    std::string_view Stored() const {
+        return std::string_view(lt.p, lt.n);
+    }
+    void Refer(std::string_view sv) {
+        lt.p = sv.data();
+        lt.n = sv.length();
+    }
+
+    // textual form, as substituted into templates
+    void AppendText(std::string &out) const {
+        char buf[512];
+        std::to_chars_result r;
+        switch(k) {
+        case K_BOOL: out += b?"true":"false"; return;
+        case K_INT: r = std::to_chars(buf, buf+sizeof(buf), i); break;
+        case K_FLOAT: r = std::to_chars(buf, buf+sizeof(buf), f, std::chars_format::fixed, 6); break; // as "%f"
+        default: out += Str(); return;
+        }
+        out.append(buf, r.ptr-buf);
+    }
+    std::string Text() const {
+        std::string ret;
+        AppendText(ret);
+        return ret;
+    }
+    bool TextEquals(const ConfyVal &other) const {
+        if(k>=K_LITERAL && other.k>=K_LITERAL) return Str()==other.Str();
+        return Text()==other.Text();
+    }
+
+    // literal as written into a variable definition
+    std::string Render() const {
+        char buf[512];
+        std::to_chars_result r;
         switch(t) {
-        case T_BOOL: return b?"true":"false";
-        case T_INT: 
-            sprintf(buf,"%d",i);
-            return buf;
-        case T_FLOAT:
-            sprintf(buf,"%f",f);
-            return buf;
-        case T_STRING:
-            return "\""+s+"\"";
+        case T_BOOL: return AsBool()?"true":"false";
+        case T_INT: r = std::to_chars(buf, buf+sizeof(buf), AsInt()); break;
+        case T_FLOAT: r = std::to_chars(buf, buf+sizeof(buf), AsFloat(), std::chars_format::fixed, 6); break; // as "%f"
+        case T_STRING: return "\""+Text()+"\"";
         default: return "\"<CORRUPTED>\"";
         }
+        return std::string(buf, r.ptr-buf);
+    }
+
+    // same type, made the same way from the same contents
+    bool Same(const ConfyVal &o) const {
+        if(t!=o.t || k!=o.k) return false;
+        switch(k) {
+        case K_BOOL: return b==o.b;
+        case K_INT: return i==o.i;
+        case K_FLOAT: return !memcmp(&f, &o.f, sizeof(f)); // -0.0 and NaNs print differently
+        default: return Str()==o.Str();
+        }
     }
 
-    void CoerceFrom(ConfyVal &other) {
-        b = other.b;
-        f = other.f;
-        i = other.i;
-        s = other.s;
+    // take other's value, seen as this value's type
+    void CoerceFrom(const ConfyVal &other) {
+        ConfyType keep = t;
+        *this = other;
+        t = keep;
     }
 
-    void CoerceFrom(ConfyVal &&other) {
-        b = other.b;
-        f = other.f;
-        i = other.i;
-        s = other.s;
+    // a long text is not copied, and has to outlive the value
+    void SetText(std::string_view sv) {
+        k = K_STRING;
+        if(sv.length()<=SHORT) {
+            memcpy(ss, sv.data(), sv.length());
+            len = sv.length();
+        } else {
+            Refer(sv);
+            len = LONG;
+        }
     }
 };
+static_assert(sizeof(ConfyVal)==16, "ConfyVal should stay compact");
 
 struct ConfyVar {
     int fl;
     std::string display;
     ConfyVal val;
     bool hidden;
+    bool defined = false; // a slot nobody has defined yet is not a variable
 };    
 
+// variable names are resolved to dense slot numbers when they are parsed, so
+// that execution can find variables by index. Shared by all files and by the
+// parse workers; slots are never reused.
+struct SymbolTable {
+    std::mutex m;
+    std::unordered_map<std::string, int> slots;
+    std::deque<std::string> names; // by slot, stable under growth
+
+    int Slot(std::string_view name) {
+        std::lock_guard<std::mutex> lk(m);
+        auto [it, added] = slots.emplace(name, names.size());
+        if(added) names.emplace_back(name);
+        return it->second;
+    }
+    // -1 if the name was never seen
+    int Find(std::string_view name) {
+        std::lock_guard<std::mutex> lk(m);
+        auto it = slots.find(std::string(name));
+        return it==slots.end() ? -1 : it->second;
+    }
+    const std::string &Name(int slot) {
+        std::lock_guard<std::mutex> lk(m);
+        return names[slot];
+    }
+} symbols;
+
+// optional performance counters, reported on stderr with --stats
+struct ConfyStats {
+    bool enabled = false;
+    double colour_secs = 0.0;
+    long long colour_bytes = 0;
+    int files_mapped = 0, files_read = 0;
+    long long bytes_loaded = 0;
+    long load_faults = 0, load_rss = 0;
+    long long arena_bytes = 0;
+    int cache_hits = 0, cache_misses = 0, cache_writes = 0;
+    long long exec_run = 0, exec_skipped = 0, exec_repeats = 0;
+    int files_written = 0, files_unchanged = 0, files_patched = 0;
+    long long bytes_written = 0;
+
+    // counters gathered while loading a file on another thread
+    void Merge(const ConfyStats &o) {
+        colour_secs += o.colour_secs;
+        colour_bytes += o.colour_bytes;
+        files_mapped += o.files_mapped;
+        files_read += o.files_read;
+        bytes_loaded += o.bytes_loaded;
+        load_faults += o.load_faults;
+        load_rss += o.load_rss;
+        arena_bytes += o.arena_bytes;
+        cache_hits += o.cache_hits;
+        cache_misses += o.cache_misses;
+        cache_writes += o.cache_writes;
+    }
+
+    static double Now() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void Report() {
+        if(!enabled) return;
+        fprintf(stderr, "== Stats: ==\n");
+        fprintf(stderr, "colourBlocks: %lld bytes in %.6fs (%.1f MB/s)\n", colour_bytes, colour_secs,
+                colour_secs>0 ? colour_bytes/colour_secs/1e6 : 0.0);
+        fprintf(stderr, "load: %d files mapped, %d read, %lld bytes; %ld page faults, RSS %+ld KB\n",
+                files_mapped, files_read, bytes_loaded, load_faults, load_rss/1024);
+        fprintf(stderr, "ast: %lld bytes in arenas\n", arena_bytes);
+        fprintf(stderr, "parse cache: %d hits, %d misses, %d written\n", cache_hits, cache_misses, cache_writes);
+        fprintf(stderr, "execution: %lld statements run, %lld skipped; %lld repeated includes replayed\n",
+                exec_run, exec_skipped, exec_repeats);
+        fprintf(stderr, "save: %d files written, %d of them patched in place, %d unchanged; %lld bytes written\n",
+                files_written, files_patched, files_unchanged, bytes_written);
+    }
+} stats;
+
+// errors found while loading a file; while a sink is set for the thread they
+// are collected instead of printed, so that files parsed ahead of time only
+// report them once they are actually included
+thread_local std::string *error_sink = NULL;
+
+void report_error(const char *fmt, ...) {
+    va_list ap, ap2;
+    va_start(ap, fmt);
+    if(error_sink) {
+        va_copy(ap2, ap);
+        int n = vsnprintf(NULL, 0, fmt, ap2);
+        va_end(ap2);
+        if(n>0) {
+            std::string msg(n, 0);
+            vsnprintf(&msg[0], n+1, fmt, ap);
+            *error_sink += msg;
+        }
+    } else vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+#include "arena.hpp"
 #include "parser_utils.hpp"
+#include "scan.hpp"
+#include "pool.hpp"
+#include "uring.hpp"
+#include "fileio.hpp"
+#include "lexer.hpp"
 
 #include "ast_def.hpp"
+#include "exec.hpp"
 
 ConfyVal boolVal(bool b) {
-    return ConfyVal { T_BOOL, b, b?1:0, b?1.0:0.0, b?"true":"false" };
+    ConfyVal v;
+    v.t = T_BOOL;
+    v.k = K_BOOL;
+    v.b = b;
+    return v;
 }
 ConfyVal intVal(int i) {
-    char buf[64];
-    sprintf(buf,"%d",i);
-    return ConfyVal { T_INT, i!=0, i, (double)i, buf };
+    ConfyVal v;
+    v.t = T_INT;
+    v.k = K_INT;
+    v.i = i;
+    return v;
 }
 ConfyVal floatVal(double f) {
+    ConfyVal v;
+    v.t = T_FLOAT;
+    v.k = K_FLOAT;
+    v.f = f;
+    return v;
+}
+// v with what it refers to, if anything, copied into arena
+ConfyVal keep_text(ConfyVal v, Arena &arena) {
+    if(v.len==ConfyVal::LONG) v.Refer(arena.copy(v.Stored()));
+    return v;
+}
+ConfyVal strVal(std::string_view sv) {
+    ConfyVal v;
+    v.t = T_STRING;
+    v.SetText(sv);
+    return v;
+}
+// number literal f, written as text; both are kept in arena
+ConfyVal litVal(std::string_view text, double f, Arena &arena) {
+    std::string rec(sizeof(f), 0);
+    memcpy(&rec[0], &f, sizeof(f));
+    rec += text;
+    ConfyVal v = floatVal(f);
+    v.k = K_LITERAL;
+    v.len = ConfyVal::LONG;
+    v.Refer(arena.copy(rec));
+    return v;
+}
+// number literal with the text it was written as. Texts that print the same
+// when computed become plain ints and floats, so that only the rest need
+// their text kept, in arena
+ConfyVal numVal(std::string_view text, double f, Arena &arena) {
     char buf[512];
-    sprintf(buf,"%f",f);
-    return ConfyVal { T_FLOAT, ((int)f)!=0, (int)f, f, buf };
+    ConfyVal v = floatVal(f);
+    int i = (int)f;
+    if((double)i==f && text==std::string_view(buf, std::to_chars(buf, buf+sizeof(buf), i).ptr-buf)) {
+        v.k = K_INT;
+        v.i = i;
+    } else if(text!=std::string_view(buf, std::to_chars(buf, buf+sizeof(buf), f, std::chars_format::fixed, 6).ptr-buf))
+        v = litVal(text, f, arena);
+    return v;
 }
 
 
 struct OpTier {
     std::vector<const char*> ops;
+    std::vector<TokKind> toks;
     std::function<ConfyVal (ConfyVal, ConfyVal, int)> ev_fun;
 };
 
 OpTier opTiers[] = {
-    { {"||"}, [] (ConfyVal v1,ConfyVal v2,int type) { return boolVal(v1.b || v2.b); } },
-    { {"&&"}, [] (ConfyVal v1,ConfyVal v2,int type) { return boolVal(v1.b && v2.b); } },
-    { {"==", "!="}, [] (ConfyVal l,ConfyVal r,int type) { 
+    { {"||"}, {TK_OROR}, [] (ConfyVal v1,ConfyVal v2,int type) { return boolVal(v1.AsBool() || v2.AsBool()); } },
+    { {"&&"}, {TK_ANDAND}, [] (ConfyVal v1,ConfyVal v2,int type) { return boolVal(v1.AsBool() && v2.AsBool()); } },
+    { {"==", "!="}, {TK_EQ, TK_NE}, [] (ConfyVal l,ConfyVal r,int type) { 
                                  bool res;
                                  switch(l.t) {
-                                 case T_BOOL: res = l.b == r.b; break;
-                                 case T_INT: res = l.i == r.i; break;
-                                 case T_FLOAT: res = l.f == r.f; break;
-                                 case T_STRING: res = l.s == r.s; break;
+                                 case T_BOOL: res = l.AsBool() == r.AsBool(); break;
+                                 case T_INT: res = l.AsInt() == r.AsInt(); break;
+                                 case T_FLOAT: res = l.AsFloat() == r.AsFloat(); break;
+                                 case T_STRING: res = l.TextEquals(r); break;
                                  default: res = false;
                                  }
                                  return boolVal(type ^ res);
                                 }
                                },
-    { {"<=", "<", ">=", ">"}, [] (ConfyVal v1,ConfyVal v2,int type) { 
+    { {"<=", "<", ">=", ">"}, {TK_LE, TK_LT, TK_GE, TK_GT}, [] (ConfyVal v1,ConfyVal v2,int type) { 
                                  if(v1.t == T_FLOAT) {
-                                    switch(type) { case 0: return boolVal(v1.f<=v2.f);
-                                                   case 1: return boolVal(v1.f<v2.f);
-                                                   case 2: return boolVal(v1.f>=v2.f);
-                                                   case 3: return boolVal(v1.f>v2.f); }
+                                    switch(type) { case 0: return boolVal(v1.AsFloat()<=v2.AsFloat());
+                                                   case 1: return boolVal(v1.AsFloat()<v2.AsFloat());
+                                                   case 2: return boolVal(v1.AsFloat()>=v2.AsFloat());
+                                                   case 3: return boolVal(v1.AsFloat()>v2.AsFloat()); }
                                  } else {
-                                    switch(type) { case 0: return boolVal(v1.i<=v2.i);
-                                                   case 1: return boolVal(v1.i<v2.i);
-                                                   case 2: return boolVal(v1.i>=v2.i);
-                                                   case 3: return boolVal(v1.i>v2.i); }
+                                    switch(type) { case 0: return boolVal(v1.AsInt()<=v2.AsInt());
+                                                   case 1: return boolVal(v1.AsInt()<v2.AsInt());
+                                                   case 2: return boolVal(v1.AsInt()>=v2.AsInt());
+                                                   case 3: return boolVal(v1.AsInt()>v2.AsInt()); }
                                  }
                                  return boolVal(false);
                                 } 
                                },
-     { {"+","-"}, [] (ConfyVal v1,ConfyVal v2,int type) {
-                                 if(v1.t == T_FLOAT) return floatVal(v1.f+(type?-1.0:1.0)*v2.f);
-                                 else return intVal(v1.i+(type?-1:1)*v2.i);
+     { {"+","-"}, {TK_PLUS, TK_MINUS}, [] (ConfyVal v1,ConfyVal v2,int type) {
+                                 if(v1.t == T_FLOAT) return floatVal(v1.AsFloat()+(type?-1.0:1.0)*v2.AsFloat());
+                                 else return intVal(v1.AsInt()+(type?-1:1)*v2.AsInt());
                                 }
                                }, 
-     { {"*","/","%"}, [] (ConfyVal v1,ConfyVal v2,int type) {
+     { {"*","/","%"}, {TK_STAR, TK_SLASH, TK_PERCENT}, [] (ConfyVal v1,ConfyVal v2,int type) {
                                  if(v1.t == T_FLOAT && type<2)
-                                     return type?floatVal(v1.f/v2.f):floatVal(v1.f*v2.f);
+                                     return type?floatVal(v1.AsFloat()/v2.AsFloat()):floatVal(v1.AsFloat()*v2.AsFloat());
                                  else switch(type) {
-                                     case 0: return intVal(v1.i*v2.i);
-                                     case 1: return intVal(v1.i/v2.i);
-                                     case 2: return intVal(v1.i%v2.i);
+                                     case 0: return intVal(v1.AsInt()*v2.AsInt());
+                                     case 1: return intVal(v1.AsInt()/v2.AsInt());
+                                     case 2: return intVal(v1.AsInt()%v2.AsInt());
                                  }
                                  return intVal(0);
                                 }
@@ -148,70 +423,89 @@ OpTier opTiers[] = {
       { { } } 
 };
 
-ConfyVal *parseValue(const char *data, const char *mask, int &pos) {
-    int d; std::string str;
+// number literals are kept in arena, long strings are views into data
+bool parseValue(const char *data, const SegMap *mask, offs_t &pos, ConfyVal &out, Arena &arena) {
+    offs_t d; std::string_view sv;
     if(d=match_string(data,mask,pos,"true")) {
         pos+=d;
-        return new ConfyVal { T_BOOL, true, 1, 1.0f, "true" };
+        out = boolVal(true);
     } else if(d=match_string(data,mask,pos,"false")) {
         pos+=d;
-        return new ConfyVal { T_BOOL, false, 0, 0.0f, "false" };
-    } else if(d=try_capture_quoted(data,mask,pos,&str)) {
+        out = boolVal(false);
+    } else if(d=try_capture_quoted(data,mask,pos,&sv)) {
         pos+=d;
-        return new ConfyVal { T_STRING, str!="", str!="", (float)(int)(str!=""), str };
+        out = strVal(sv);
     } else { 
         char *endptr;
-        int pos0=pos;
         double v = strtod(data+pos, &endptr);
         if(endptr>(data+pos)) {
+            out = numVal(std::string_view(data+pos, endptr-(data+pos)), v, arena);
             pos+=(endptr-(data+pos));
-            return new ConfyVal { T_FLOAT, (bool)(int)v, (int)v, v, std::string(data+pos0, pos-pos0) };
         } else {
-            return NULL;
+            return false;
         }
     }
+    return true;
 }
 
-#define FAIL(s,...) { fprintf(stderr, "ERROR: " s "\n" __VA_OPT__(,) __VA_ARGS__); return false; }
+#define FAIL(s,...) { report_error("ERROR: " s "\n" __VA_OPT__(,) __VA_ARGS__); return false; }
 struct ConfyFile {
     std::string fname;
     std::string fpath;
-    int size;
-    char *data;
-    char *mask;
-    int setup_start, setup_end;
+    FileBuffer buf;
+    Arena arena; // owns the AST
+    offs_t size;
+    const char *data;
+    SegMap segs;
+    offs_t setup_start, setup_end;
 
     SyntaxNode *s;
+    std::vector<std::string> includes; // file names of include statements, for prefetching
+
+    // last run from an include statement, see ConfyState::IncludeFile
+    int run_pass = 0;
+    ExecMemo *run_memo = NULL; // that statement's record
+    uint64_t run_start = 0;    // exec clock when it started
+
+    // what the file on disk holds: buf with the ranges patched in place
+    // since, until it is rewritten as a whole, after which only the size,
+    // mtime and a hash of the contents are known
+    KnownContents disk;
+    bool rewritten = false;
+    uint64_t rewritten_hash = 0;
 
     struct {
         std::string line, block_start, block_end, meta_line, meta_block_start, meta_block_end;
     } setup;
 
+    // runs before colouring, so the whole file is treated as metacode
     bool parseSetup() {
-        int pos=0, d;
-        while(pos<size) {
-            if(d=match_string(data, mask, pos, "confy-setup")) {
+        offs_t pos=0, d;
+        ByteSet first;
+        first.add('c');
+        while((pos=scan_for_any(data, pos, size, first))<size) {
+            if(d=match_string(data, NULL, pos, "confy-setup")) {
                 setup_start = pos;
                 pos+=d;
 
-                pos+=eat_whitespace(data, mask, pos);
-                if(!(d=match_string(data, mask, pos, "{")))
+                pos+=eat_whitespace(data, NULL, pos);
+                if(!(d=match_string(data, NULL, pos, "{")))
                     FAIL("Expected '{' after confy-setup");
                 pos+=d;
                 
-                pos+=eat_whitespace(data, mask, pos);
-                while(!match_string(data, mask, pos, "}") && !match_eof(data, mask, pos)) {
-                    pos+=eat_whitespace(data, mask, pos);
+                pos+=eat_whitespace(data, NULL, pos);
+                while(!match_string(data, NULL, pos, "}") && !match_eof(data, NULL, pos)) {
+                    pos+=eat_whitespace(data, NULL, pos);
                     
-                    std::string key = capture_ident(data,mask,&pos);
-                    pos+=eat_whitespace(data, mask, pos);
-                    if(!(d=match_string(data, mask, pos, ":")))
+                    std::string_view key = capture_ident(data,NULL,&pos);
+                    pos+=eat_whitespace(data, NULL, pos);
+                    if(!(d=match_string(data, NULL, pos, ":")))
                         FAIL("Expected ':' after confy-setup key");
                     pos+=d;
-                    pos+=eat_whitespace(data, mask, pos);
+                    pos+=eat_whitespace(data, NULL, pos);
                     
-                    std::string value;
-                    if(!(d=try_capture_quoted(data,mask,pos,&value)))
+                    std::string_view value;
+                    if(!(d=try_capture_quoted(data,NULL,pos,&value)))
                         FAIL("Expected quoted string for confy-setup value");
                     pos+=d;
 
@@ -222,16 +516,17 @@ struct ConfyFile {
                     SETUP_STRING(meta_line)
                     SETUP_STRING(meta_block_start)
                     SETUP_STRING(meta_block_end)
-                    { FAIL("Unknown confy-setup key: '%s'", key.c_str()); }
+                    { FAIL("Unknown confy-setup key: '%.*s'", (int)key.length(), key.data()); }
                     #undef SETUP_STRING
 
 //                    printf("key: %s val: '%s'\n", key.c_str(), value.c_str());
 
-                    pos+=eat_whitespace(data, mask, pos);
-                    pos+=match_string(data, mask, pos, ","); 
+                    pos+=eat_whitespace(data, NULL, pos);
+                    pos+=match_string(data, NULL, pos, ","); 
                 }
-                if(match_string(data, mask, pos, "}")) {
+                if(match_string(data, NULL, pos, "}")) {
                     setup_end = pos+1;
+                    compileDelimiters();
                     return true;
                 } else return false;
             } else ++pos;
@@ -239,80 +534,84 @@ struct ConfyFile {
         return false;
     }
 
-    void paintMask(int pos, int d, Mask clr) {
-        memset(mask+pos, (char)clr, d);
+    void paintMask(offs_t pos, offs_t d, Mask clr) {
+        segs.paint(pos, d, clr);
+    }
+
+    // delimiter automata for each colouring state, compiled by parseSetup
+    DelimDFA dfa_active, dfa_line_end, dfa_block_end, dfa_meta_block_end;
+
+    void compileDelimiters() {
+        // priority order matches the order transitions out of active code are tried in
+        dfa_active.Build({ setup.line, setup.block_start, setup.meta_line, setup.meta_block_start });
+        dfa_line_end.Build({ "\n" });
+        dfa_block_end.Build({ setup.block_end });
+        dfa_meta_block_end.Build({ setup.meta_block_end });
     }
 
     bool colourBlocks() {
-        int pos=0, pos0=0, d;
+        offs_t pos=0, pos0=0, mpos, d, evicted=0;
+        int k;
         bool is_line_comment;
         Mask st = Mask::M_ACTIVE;
 
-        // overpaint confy-setup block
-//        printf("protect %d..%d\n", setup_start, setup_end);
-        paintMask(setup_start, setup_end-setup_start, Mask::M_PROTECTED);
+        segs.segs.clear();
 
         while(pos<size) {
+            // the scan only moves forward, so what it has passed need not stay resident
+            if(pos-evicted >= (offs_t)FileBuffer::EVICT_CHUNK) {
+                buf.Evict(data+evicted, pos-evicted);
+                evicted = pos;
+            }
+            // delimiters never overlap the protected confy-setup block
+            if(pos>=setup_start && pos<setup_end) pos=setup_end;
+            offs_t end = pos<setup_start ? setup_start : size;
+
+            const DelimDFA *dfa;
+            switch(st) {
+            case Mask::M_ACTIVE: dfa=&dfa_active; break;
+            case Mask::M_INERT: dfa=is_line_comment?&dfa_line_end:&dfa_block_end; break;
+            default: dfa=is_line_comment?&dfa_line_end:&dfa_meta_block_end; break;
+            }
+            // look at huge files one window at a time; a match that is too close
+            // to the end of the window may lose to one extending past it, so
+            // that part is looked at again with the next window
+            offs_t lim = end, safe = end;
+            if(end-pos > (offs_t)FileBuffer::EVICT_CHUNK) {
+                lim = pos+FileBuffer::EVICT_CHUNK;
+                safe = lim-std::max(dfa->maxlen-1, 0);
+            }
+            if((k=dfa->Find(data, pos, lim, &mpos))<0 || mpos>=safe) {
+                pos = lim<end ? safe : end;
+                continue;
+            }
+            d=dfa->lens[k];
+            pos=mpos;
+
             switch(st) {
             case Mask::M_ACTIVE:
                 // currently inside active source code, transition to line or block comments
-                if(d=match_string(data, mask, pos, setup.line.c_str())) {
-                    paintMask(pos0, pos-pos0, st);
-                    paintMask(pos, d, Mask::M_INERT_LINE_IN);
-                    pos=pos0=pos+d;
-                    st=Mask::M_INERT; is_line_comment=true;
-                } else if(d=match_string(data, mask, pos, setup.block_start.c_str())) {
-                    paintMask(pos0, pos-pos0, st);
-                    paintMask(pos, d, Mask::M_INERT_BLOCK_IN);
-                    pos=pos0=pos+d;
-                    st=Mask::M_INERT; is_line_comment=false;
-                } else if(d=match_string(data, mask, pos, setup.meta_line.c_str())) {
-                    paintMask(pos0, pos-pos0, st);
-                    paintMask(pos, d, Mask::M_META_LINE_IN);
-                    pos=pos0=pos+d;
-                    st=Mask::M_META; is_line_comment=true;
-                } else if(d=match_string(data, mask, pos, setup.meta_block_start.c_str())) {
-                    paintMask(pos0, pos-pos0, st);
-                    paintMask(pos, d, Mask::M_META_BLOCK_IN);
-                    pos=pos0=pos+d;
-                    st=Mask::M_META; is_line_comment=false;
-                } else ++pos;
-                break;
-            case Mask::M_INERT:
-                if(is_line_comment) {
-                    // currently inside inactivated line of source code, transition back after newline
-                    if(d=match_string(data, mask, pos, "\n")) {
-                        paintMask(pos0, d+pos-pos0, st);
-                        pos=pos0=pos+d;
-                        st=Mask::M_ACTIVE;
-                    } else ++pos;
-                } else {
-                    // currently inside inactivated block, transition back on comment close
-                    if(d=match_string(data, mask, pos, setup.block_end.c_str())) {
-                        paintMask(pos0, pos-pos0, st);
-                        paintMask(pos, d, Mask::M_INERT_BLOCK_OUT);
-                        pos=pos0=pos+d;
-                        st=Mask::M_ACTIVE;
-                    } else ++pos;
+                paintMask(pos0, pos-pos0, st);
+                switch(k) {
+                case 0: paintMask(pos, d, Mask::M_INERT_LINE_IN); st=Mask::M_INERT; is_line_comment=true; break;
+                case 1: paintMask(pos, d, Mask::M_INERT_BLOCK_IN); st=Mask::M_INERT; is_line_comment=false; break;
+                case 2: paintMask(pos, d, Mask::M_META_LINE_IN); st=Mask::M_META; is_line_comment=true; break;
+                case 3: paintMask(pos, d, Mask::M_META_BLOCK_IN); st=Mask::M_META; is_line_comment=false; break;
                 }
+                pos=pos0=pos+d;
                 break;
+            case Mask::M_INERT:
             case Mask::M_META:
                 if(is_line_comment) {
-                    // currently inside line of confy metainstructions, transition back after newline
-                    if(d=match_string(data, mask, pos, "\n")) {
-                        paintMask(pos0, d+pos-pos0, st);
-                        pos=pos0=pos+d;
-                        st=Mask::M_ACTIVE;
-                    } else ++pos;
+                    // currently inside a commented line, transition back after newline
+                    paintMask(pos0, d+pos-pos0, st);
                 } else {
-                    // currently inside inactivated block, transition back on comment close
-                    if(d=match_string(data, mask, pos, setup.meta_block_end.c_str())) {
-                        paintMask(pos0, pos-pos0, st);
-                        paintMask(pos, d, Mask::M_META_BLOCK_OUT);
-                        pos=pos0=pos+d;
-                        st=Mask::M_ACTIVE;
-                    } else ++pos;
+                    // currently inside a comment block, transition back on comment close
+                    paintMask(pos0, pos-pos0, st);
+                    paintMask(pos, d, st==Mask::M_INERT?Mask::M_INERT_BLOCK_OUT:Mask::M_META_BLOCK_OUT);
                 }
+                pos=pos0=pos+d;
+                st=Mask::M_ACTIVE;
                 break;
             }
         }
@@ -322,114 +621,154 @@ struct ConfyFile {
         return true;
     }
 
-    #define STR_OR_FAIL(s) \
-            if(!(d=match_string(data,mask,pos,s))) return NULL; \
+    #define THROW(err...) { char err_buf[1024]; snprintf(err_buf, sizeof(err_buf), err); throw std::string(err_buf); }
+
+    #define TOK_OR_THROW(k,err...) \
+            if(!(d=matchTok(pos,k))) THROW(err) \
             pos+=d; 
 
-    #define THROW(err...) { char err_buf[1024]; sprintf(err_buf, err); throw std::string(err_buf); }
+    TokenList toks;
 
-    #define STR_OR_THROW(s,err...) \
-            if(!(d=match_string(data,mask,pos,s))) THROW(err) \
-            pos+=d; 
+    TokKind peekTok(offs_t pos) {
+        const Token *t = toks.at(pos);
+        return t ? t->kind : TK_EOF;
+    }
+
+    // length of the token of kind k starting at pos, or 0
+    offs_t matchTok(offs_t pos, TokKind k) {
+        const Token *t = toks.at(pos);
+        return (t && t->kind==k) ? t->len : 0;
+    }
 
-    Expr *parseExpr(int &pos, int tier);
-    Expr *parseExprSingleton(int &pos) {
-        int d;
+    // 'true' | 'false' | "<string>" | <number>
+    bool parseLiteral(offs_t &pos, ConfyVal &v) {
+        const Token *t = toks.at(pos);
+        if(!t) return false;
+        switch(t->kind) {
+        case TK_TRUE:
+            v = boolVal(true);
+            break;
+        case TK_FALSE:
+            v = boolVal(false);
+            break;
+        case TK_QUOTED:
+            v = strVal(std::string_view(data+t->start+1, t->len-2));
+            break;
+        default: {
+            // anything strtod accepts, including a sign
+            char *endptr;
+            double dv = strtod(data+pos, &endptr);
+            if(endptr==data+pos) return false;
+            v = numVal(std::string_view(data+pos, endptr-(data+pos)), dv, arena);
+            pos = endptr-data;
+            return true;
+        }
+        }
+        pos += t->len;
+        v = keep_text(v, arena);
+        return true;
+    }
+
+    Expr *parseExpr(offs_t &pos, int tier);
+    Expr *parseExprSingleton(offs_t &pos) {
+        offs_t d;
         std::string vn;
-        if(d=match_string(data,mask,pos,"!")) {
+        ConfyVal v;
+        if(d=matchTok(pos,TK_NOT)) {
             pos+=d;
-            pos+=eat_whitespace(data,mask,pos);
+            pos+=eat_whitespace(data,&segs,pos);
             Expr *sub = parseExprSingleton(pos);
-            ExprNot *e = new ExprNot();
+            ExprNot *e = arena.make<ExprNot>();
             e->sub = sub;
             return e;
-        } else if(d=match_string(data,mask,pos,"-")) {
+        } else if(d=matchTok(pos,TK_MINUS)) {
             pos+=d;
-            pos+=eat_whitespace(data,mask,pos);
+            pos+=eat_whitespace(data,&segs,pos);
             Expr *sub = parseExprSingleton(pos);
-            ExprNeg *e = new ExprNeg();
+            ExprNeg *e = arena.make<ExprNeg>();
             e->sub = sub;
             return e;
-        } else if(d=match_string(data,mask,pos,"(")) {
+        } else if(d=matchTok(pos,TK_LPAREN)) {
             pos+=d;
-            pos+=eat_whitespace(data,mask,pos);
+            pos+=eat_whitespace(data,&segs,pos);
             Expr *sub = parseExpr(pos,0);
-            STR_OR_THROW(")", "Expected ')'");
+            TOK_OR_THROW(TK_RPAREN, "Expected ')'");
             return sub;
         } else if(d=tryVarName(pos, vn)) {
             pos+=d;
-            ExprVar *sub = new ExprVar();
+            ExprVar *sub = arena.make<ExprVar>();
             sub->name = vn;
+            sub->slot = symbols.Slot(vn);
             return sub;
-        } else if(ConfyVal *v=parseValue(data,mask,pos)) {
-            ExprLiteral *sub = new ExprLiteral();
-            sub->v = *v;
+        } else if(parseLiteral(pos, v)) {
+            ExprLiteral *sub = arena.make<ExprLiteral>();
+            sub->v = v;
             return sub;
         } else THROW("Expected '!', '-', parenthesized expression, variable name or literal");
     }
 
 
-    SyntaxNode *parseExpr(int &pos) {
-        int pos0=pos;
+    SyntaxNode *parseExpr(offs_t &pos) {
+        offs_t pos0=pos;
 
-        pos += eat_whitespace(data,mask,pos);
+        pos += eat_whitespace(data,&segs,pos);
         Expr *sub = parseExpr(pos,0);
-        ExprNode *n = new ExprNode();
-        n->source = std::string(data+pos0, pos-pos0);
+        ExprNode *n = arena.make<ExprNode>();
+        n->source = std::string_view(data+pos0, pos-pos0);
         n->root = sub;
+        n->Compile(arena);
 
         return n;
     }
 
     // '$' <identifier>
-    int tryVarName(int pos, std::string &n) {
-        int pos0=pos;
-        int d;
-        if(!(d=match_string(data,mask,pos,"$"))) return 0;
-        pos+=d;
-        n=capture_ident(data,mask,&pos);
-        if(!n.length()) THROW("Expected nonempty variable name after '$'");
-        return pos-pos0;
+    offs_t tryVarName(offs_t pos, std::string &n) {
+        offs_t d;
+        if(!(d=matchTok(pos,TK_VAR))) return 0;
+        if(d==1) THROW("Expected nonempty variable name after '$'");
+        n=std::string(data+pos+1, d-1);
+        return d;
     }
 
     // 'include' '(' "<filename>" ')' ';'
-    SyntaxNode *parseInclude(int &pos) {
-        int pos0=pos, d;
+    SyntaxNode *parseInclude(offs_t &pos) {
+        offs_t pos0=pos, d;
         Include *ret;
 
-        if(!(d=match_string(data,mask,pos,"include"))) return NULL;
+        if(!(d=matchTok(pos,TK_INCLUDE))) return NULL;
         pos+=d;
 
-        ret = new Include();
+        ret = arena.make<Include>();
         
-        pos+=eat_whitespace(data,mask,pos);
+        pos+=eat_whitespace(data,&segs,pos);
         
-        STR_OR_THROW("(", "Expected '(' after 'include'");
+        TOK_OR_THROW(TK_LPAREN, "Expected '(' after 'include'");
 
-        pos+=eat_whitespace(data,mask,pos);
+        pos+=eat_whitespace(data,&segs,pos);
 
-        std::string _fname;
-        if(!(d=try_capture_quoted(data,mask,pos,&_fname)))
+        if(!(d=matchTok(pos,TK_QUOTED)))
             THROW("Expected quoted filename in 'include'");
+        std::string_view _fname(data+pos+1, d-2);
         pos+=d;
 
-        pos+=eat_whitespace(data,mask,pos);
+        pos+=eat_whitespace(data,&segs,pos);
         
-        STR_OR_THROW(")", "Expected ')' after filename");
+        TOK_OR_THROW(TK_RPAREN, "Expected ')' after filename");
 
-        pos+=eat_whitespace(data,mask,pos);
+        pos+=eat_whitespace(data,&segs,pos);
 
-        STR_OR_THROW(";", "Expected ')' after filename");
+        TOK_OR_THROW(TK_SEMI, "Expected ')' after filename");
 
         ret->fname=_fname;
-        ret->source = std::string(data+pos0, pos-pos0);
+        includes.push_back(ret->fname);
+        ret->source = std::string_view(data+pos0, pos-pos0);
 
         return ret;
     }
 
     // <varname> '=' <expr> ';'
-    SyntaxNode *parseVarAssign(int &pos) {
-        int pos0=pos, d;
+    SyntaxNode *parseVarAssign(offs_t &pos) {
+        offs_t pos0=pos, d;
         VarAssign *ret;
 
         std::string varname;
@@ -437,110 +776,114 @@ struct ConfyFile {
         pos+=tryVarName(pos, varname);
         if(!varname.length()) return NULL;
 
-        ret = new VarAssign();
+        ret = arena.make<VarAssign>();
         ret->varname = varname;
+        ret->slot = symbols.Slot(varname);
 
-        pos+=eat_whitespace(data,mask,pos);
+        pos+=eat_whitespace(data,&segs,pos);
 
-        STR_OR_THROW("=", "Expected '=' after variable name");
+        TOK_OR_THROW(TK_ASSIGN, "Expected '=' after variable name");
 
-        pos+=eat_whitespace(data,mask,pos);
+        pos+=eat_whitespace(data,&segs,pos);
         
         ret->expr = parseExpr(pos);
 
         if(!ret->expr) THROW("Expected expression after '='");
 
-        pos+=eat_whitespace(data,mask,pos);
+        pos+=eat_whitespace(data,&segs,pos);
 
-        STR_OR_THROW(";", "Expected ';' after assignment");
+        TOK_OR_THROW(TK_SEMI, "Expected ';' after assignment");
 
-        ret->source = std::string(data+pos0, pos-pos0);
+        ret->source = std::string_view(data+pos0, pos-pos0);
 
         return ret;
     }
 
     // ['hidden'] <type> <varname> ["<friendly name>"] '=' <value> ';'
-    SyntaxNode *parseVarDef(int &pos) {
-        int pos0=pos, d;
+    SyntaxNode *parseVarDef(offs_t &pos) {
+        offs_t pos0=pos, d;
         VarDef *ret;
 
         bool hidden=false;
 
-        if(d=match_string(data,mask,pos,"hidden")) {
+        if(d=matchTok(pos,TK_HIDDEN)) {
             hidden=true;
             pos+=d;
-            pos+=eat_whitespace(data,mask,pos);
+            pos+=eat_whitespace(data,&segs,pos);
         }
 
-        if(d=match_string(data,mask,pos,"bool")) {
-            ret = new VarDef();
+        if(d=matchTok(pos,TK_BOOL)) {
+            ret = arena.make<VarDef>();
             ret->v.val.t = T_BOOL;
-        } else if(d=match_string(data,mask,pos,"string")) {
-            ret = new VarDef();
+        } else if(d=matchTok(pos,TK_STRING)) {
+            ret = arena.make<VarDef>();
             ret->v.val.t = T_STRING;
-        } else if(d=match_string(data,mask,pos,"int")) {
-            ret = new VarDef();
+        } else if(d=matchTok(pos,TK_INT)) {
+            ret = arena.make<VarDef>();
             ret->v.val.t = T_INT;
-        } else if(d=match_string(data,mask,pos,"float")) {
-            ret = new VarDef();
+        } else if(d=matchTok(pos,TK_FLOAT)) {
+            ret = arena.make<VarDef>();
             ret->v.val.t = T_FLOAT;
         } else return NULL;
         pos+=d;
-        pos+=eat_whitespace(data,mask,pos);
+        pos+=eat_whitespace(data,&segs,pos);
 
         ret->hidden = hidden;
 
         ret->name = "";
         pos+=tryVarName(pos,ret->name);
         if(!ret->name.length()) THROW("Expected variable name after type name");
+        ret->slot = symbols.Slot(ret->name);
 
-        pos+=eat_whitespace(data,mask,pos);
+        pos+=eat_whitespace(data,&segs,pos);
 
         // optional friendly name, like int $winSize "Window Size" = 3;
-        pos+=try_capture_quoted(data,mask,pos,&ret->v.display);
+        if(d=matchTok(pos,TK_QUOTED)) {
+            ret->v.display = std::string(data+pos+1, d-2);
+            pos+=d;
+        }
         if(!ret->v.display.length()) ret->v.display = ret->name;
 
-        pos+=eat_whitespace(data,mask,pos);
+        pos+=eat_whitespace(data,&segs,pos);
 
-        STR_OR_THROW("=", "Expected '=' in variable definition");
-        pos+=eat_whitespace(data,mask,pos);
+        TOK_OR_THROW(TK_ASSIGN, "Expected '=' in variable definition");
+        pos+=eat_whitespace(data,&segs,pos);
         
-        ret->pre = std::string(data+pos0, pos-pos0);
+        ret->pre = std::string_view(data+pos0, pos-pos0);
 
-        ConfyVal *va = parseValue(data,mask,pos);
-        if(!va) return NULL;
+        ConfyVal va;
+        if(!parseLiteral(pos, va)) return NULL;
 
         pos0=pos;
 
-        ret->v.val.CoerceFrom(*va);
-        delete va;
+        ret->v.val.CoerceFrom(va);
 
-        STR_OR_THROW(";", "Expected ';' after variable definition");
+        TOK_OR_THROW(TK_SEMI, "Expected ';' after variable definition");
 
-        ret->post = std::string(data+pos0, pos-pos0);
+        ret->post = std::string_view(data+pos0, pos-pos0);
 
         return ret;
     }
 
     // 'if' '(' <expression> ')' '{' <sequence> '}' [ 'else'  ( <if> | ( '{' <sequence> '}' ) ) ] 
-    SyntaxNode *parseIf(int &pos) {
-        int pos0=pos, pos1, pos2, d;
-        if(d=match_string(data,mask,pos,"if")) {
+    SyntaxNode *parseIf(offs_t &pos) {
+        offs_t pos0=pos, pos1, pos2, d;
+        if(d=matchTok(pos,TK_IF)) {
             SyntaxNode *cond, *body;
 
             pos+=d;
 
-            pos+=eat_whitespace(data,mask,pos);
+            pos+=eat_whitespace(data,&segs,pos);
 
-            STR_OR_THROW("(", "'if' must be followed by '('");
+            TOK_OR_THROW(TK_LPAREN, "'if' must be followed by '('");
 
             cond=parseExpr(pos);
 
-            STR_OR_THROW(")", "'if' condition must be closed by ')'");
+            TOK_OR_THROW(TK_RPAREN, "'if' condition must be closed by ')'");
 
-            pos+=eat_whitespace(data,mask,pos);
+            pos+=eat_whitespace(data,&segs,pos);
 
-            STR_OR_THROW("{", "'if' condition must be followed by '{'");
+            TOK_OR_THROW(TK_LBRACE, "'if' condition must be followed by '{'");
 
             pos1=pos;
 
@@ -548,52 +891,55 @@ struct ConfyFile {
 
             pos2=pos;
 
-            STR_OR_THROW("}", "'if' block must be followed by '}'");
+            TOK_OR_THROW(TK_RBRACE, "'if' block must be followed by '}'");
 
-            pos+=eat_whitespace(data,mask,pos);
+            pos+=eat_whitespace(data,&segs,pos);
 
-            if(d=match_string(data,mask,pos,"else")) {
+            if(d=matchTok(pos,TK_ELSE)) {
                 pos+=d;
-                IfThenElse *s = new IfThenElse();
-                s->pre = std::string(data+pos0, pos1-pos0);
+                IfThenElse *s = arena.make<IfThenElse>();
+                s->pre = std::string_view(data+pos0, pos1-pos0);
                 s->cond = cond;
                 s->sub1 = body;
-                pos+=eat_whitespace(data,mask,pos);
-                s->inter = std::string(data+pos2, pos-pos2);
+                body->parent = s;
+                pos+=eat_whitespace(data,&segs,pos);
+                s->inter = std::string_view(data+pos2, pos-pos2);
                 SyntaxNode *alt;
                 if(!(alt=parseIf(pos))) {
-                    STR_OR_THROW("{", "Expected '{' or 'if' after 'else'");
-                    s->inter = std::string(data+pos2, pos-pos2);
+                    TOK_OR_THROW(TK_LBRACE, "Expected '{' or 'if' after 'else'");
+                    s->inter = std::string_view(data+pos2, pos-pos2);
                     alt=parseSeq(pos);
-                    STR_OR_THROW("}", "Expected '}' after else-block");
+                    TOK_OR_THROW(TK_RBRACE, "Expected '}' after else-block");
                     s->post = "}";
                 } else {
                     s->post = "";
                 }
                 s->sub2 = alt;
+                alt->parent = s;
                 return s;
             } else {
-                IfThen *s = new IfThen();
-                s->pre = std::string(data+pos0, pos1-pos0);
-                s->post = std::string(data+pos2, pos-pos2);
+                IfThen *s = arena.make<IfThen>();
+                s->pre = std::string_view(data+pos0, pos1-pos0);
+                s->post = std::string_view(data+pos2, pos-pos2);
                 s->cond = cond;
                 s->sub = body;
+                body->parent = s;
                 return s;
             }
         } else return NULL;
     }
 
     // 'if' '(' <expression> ')' '{' <sequence> '}' [ 'else'  ( <if> | ( '{' <sequence> '}' ) ) ] 
-    SyntaxNode *parseTemplate(int &pos) {
-        int pos0=pos, pos1, pos2, d;
-        if(d=match_string(data,mask,pos,"template")) {
+    SyntaxNode *parseTemplate(offs_t &pos) {
+        offs_t pos0=pos, pos1, pos2, d;
+        if(d=matchTok(pos,TK_TEMPLATE)) {
             SyntaxNode *pattern, *body;
 
             pos+=d;
 
-            pos+=eat_whitespace(data,mask,pos);
+            pos+=eat_whitespace(data,&segs,pos);
 
-            STR_OR_THROW("{", "'template' must be followed by '{'");
+            TOK_OR_THROW(TK_LBRACE, "'template' must be followed by '{'");
 
             pos1=pos;
 
@@ -601,26 +947,28 @@ struct ConfyFile {
 
             pos2=pos;
 
-            STR_OR_THROW("}", "'template' block must terminate in '}'");
+            TOK_OR_THROW(TK_RBRACE, "'template' block must terminate in '}'");
 
-            pos+=eat_whitespace(data,mask,pos);
+            pos+=eat_whitespace(data,&segs,pos);
 
-            STR_OR_THROW("into", "'template' block must be followed by 'into'");
+            TOK_OR_THROW(TK_INTO, "'template' block must be followed by 'into'");
 
-            Template *s = new Template();
-            s->pre = std::string(data+pos0, pos1-pos0);
+            Template *s = arena.make<Template>();
+            s->pre = std::string_view(data+pos0, pos1-pos0);
             s->temp = pattern;
+            pattern->parent = s;
+            s->Compile();
             
-            pos+=eat_whitespace(data,mask,pos);
+            pos+=eat_whitespace(data,&segs,pos);
             
             SyntaxNode *alt;
             
-            STR_OR_THROW("{", "Expected '{' after 'into'");
+            TOK_OR_THROW(TK_LBRACE, "Expected '{' after 'into'");
             
-            s->inter = std::string(data+pos2, pos-pos2);
+            s->inter = std::string_view(data+pos2, pos-pos2);
             alt=parseSeq(pos); // only checked for syntactic coherence
             
-            STR_OR_THROW("}", "Expected '}' after into-block");
+            TOK_OR_THROW(TK_RBRACE, "Expected '}' after into-block");
             s->post = "}";
             s->out = ""; // no need to prerender
             return s;
@@ -628,261 +976,728 @@ struct ConfyFile {
     }
 
     // sequence of basic blocks
-    Seq *parseSeq(int &pos) {
-        Seq *ret = new Seq;
-        int d;
+    Seq *parseSeq(offs_t &pos) {
+        Seq *ret = arena.make<Seq>();
+        offs_t d;
         while(pos<size) {
             SyntaxNode *n;
-            if(d=match_while(data,mask,pos,is_mask_eq((char)Mask::M_ACTIVE))) {
-                SourceBlock *s = new SourceBlock();
+            if(d=segs.runLength(pos,Mask::M_ACTIVE)) {
+                SourceBlock *s = arena.make<SourceBlock>();
                 s->bType = SourceBlock::B_ACTIVE;
-                s->contents = std::string(data+pos, d);
+                s->contents = std::string_view(data+pos, d);
                 ret->children.push_back(s);
                 pos+=d;
-            } else if(d=match_while(data,mask,pos,is_mask_eq((char)Mask::M_INERT_LINE_IN))) {
+            } else if(d=segs.runLength(pos,Mask::M_INERT_LINE_IN)) {
                 pos+=d;
-                SourceBlock *s = new SourceBlock();
+                SourceBlock *s = arena.make<SourceBlock>();
                 s->bType = SourceBlock::B_INERT_LINE;
-                s->contents = capture_while(data,mask,&pos,is_mask_eq((char)Mask::M_INERT));
+                d=segs.runLength(pos,Mask::M_INERT);
+                s->contents = std::string_view(data+pos, d);
+                pos+=d;
                 ret->children.push_back(s);
-            } else if(d=match_while(data,mask,pos,is_mask_eq((char)Mask::M_INERT_BLOCK_IN))) {
+            } else if(d=segs.runLength(pos,Mask::M_INERT_BLOCK_IN)) {
                 pos+=d;
-                SourceBlock *s = new SourceBlock();
+                SourceBlock *s = arena.make<SourceBlock>();
                 s->bType = SourceBlock::B_INERT_BLOCK;
-                s->contents = capture_while(data,mask,&pos,is_mask_eq((char)Mask::M_INERT));
+                d=segs.runLength(pos,Mask::M_INERT);
+                s->contents = std::string_view(data+pos, d);
+                pos+=d;
                 ret->children.push_back(s);
-                d=match_while(data,mask,pos,is_mask_eq((char)Mask::M_INERT_BLOCK_OUT));
+                d=segs.runLength(pos,Mask::M_INERT_BLOCK_OUT);
                 pos+=d;
-            } else if(   (d=match_while(data,mask,pos,is_mask_eq((char)Mask::M_META_LINE_IN)))
-                      || (d=match_while(data,mask,pos,is_mask_eq((char)Mask::M_META_BLOCK_IN)))
-                      || (d=match_while(data,mask,pos,is_mask_eq((char)Mask::M_META_BLOCK_OUT)))
-                      || (d=match_while(data,mask,pos,is_mask_eq((char)Mask::M_PROTECTED)))
-                      || (d=eat_whitespace(data,mask,pos))
+            } else if(   (d=segs.runLength(pos,Mask::M_META_LINE_IN))
+                      || (d=segs.runLength(pos,Mask::M_META_BLOCK_IN))
+                      || (d=segs.runLength(pos,Mask::M_META_BLOCK_OUT))
+                      || (d=segs.runLength(pos,Mask::M_PROTECTED))
+                      || (d=eat_whitespace(data,&segs,pos))
                      ) {
-                SourceBlock *s = new SourceBlock();
+                SourceBlock *s = arena.make<SourceBlock>();
                 s->bType = SourceBlock::B_META_CHAFF;
-                s->contents = std::string(data+pos, d);
+                s->contents = std::string_view(data+pos, d);
                 ret->children.push_back(s);
                 pos+=d;
-            } else if(match_eof(data,mask,pos) || match_string(data, mask, pos, "}")) {
+            } else if(match_eof(data,&segs,pos) || matchTok(pos,TK_RBRACE)) {
                 break;
-            } else if(n=parseIf(pos)) {
-                ret->children.push_back(n); 
-            } else if(n=parseTemplate(pos)) {
-                ret->children.push_back(n);
-            } else if(n=parseVarDef(pos)) {
-                ret->children.push_back(n);
-            } else if(n=parseVarAssign(pos)) {
-                ret->children.push_back(n); 
-            } else if(n=parseInclude(pos)) {
-                ret->children.push_back(n);
             } else {
-                THROW("Unexpected '%s' in mode '%d'", data+pos, mask[pos]);
-                return NULL;
+                // the leading token decides the construct
+                switch(peekTok(pos)) {
+                case TK_IF: n=parseIf(pos); break;
+                case TK_TEMPLATE: n=parseTemplate(pos); break;
+                case TK_HIDDEN: case TK_BOOL: case TK_STRING: case TK_INT: case TK_FLOAT: n=parseVarDef(pos); break;
+                case TK_VAR: n=parseVarAssign(pos); break;
+                case TK_INCLUDE: n=parseInclude(pos); break;
+                default: n=NULL;
+                }
+                if(!n) THROW("Unexpected '%s' in mode '%d'", data+pos, (int)segs.at(pos));
+                ret->children.push_back(n);
             }
         }
+        for(auto n : ret->children) n->parent = ret;
         return ret;
     }
     bool parseBody() {
-        int pos=0;
+        offs_t pos=0;
+        toks.Lex(data, segs);
         try {
             s=parseSeq(pos);
         } catch(std::string err) {
-            fprintf(stderr, "PARSE ERROR at '%s' byte %d: %s\n", fname.c_str(), pos, err.c_str());
-            fprintf(stderr, "TAIL: %.64s\n", data+pos);
+            report_error("PARSE ERROR at '%s' byte %lld: %s\n", fname.c_str(), (long long)pos, err.c_str());
+            report_error("TAIL: %.64s\n", data+pos);
             return false;
         }
+        toks = TokenList(); // only needed while parsing
         return (s!=NULL);
     }
 };
 
-Expr *ConfyFile::parseExpr(int &pos, int tier) {
-    int d;
+Expr *ConfyFile::parseExpr(offs_t &pos, int tier) {
+    offs_t d;
 
     // bottom of precedence list
     if(!opTiers[tier].ops.size()) {
         return parseExprSingleton(pos);
     }
 
-    ExprOp *ret = new ExprOp();
-
     Expr *sub = parseExpr(pos, tier+1),*sub1;
-
-    ret->op = opTiers[tier].ev_fun;
-    ret->subexprs.push_back(sub);
-    ret->subtypes.push_back(0);
+    ExprOp *ret = NULL;
 
     while(1) {
-        pos += eat_whitespace(data,mask,pos);
+        pos += eat_whitespace(data,&segs,pos);
         int index=0;
         for(;index<opTiers[tier].ops.size();++index) {
-            if(d=match_string(data,mask,pos,opTiers[tier].ops[index])) break; 
+            if(d=matchTok(pos,opTiers[tier].toks[index])) break; 
         }
         if(index==opTiers[tier].ops.size()) break; // can't extend this expr tier
         pos += d;
 
-        pos += eat_whitespace(data,mask,pos);
+        if(!ret) {
+            ret = arena.make<ExprOp>();
+            ret->tier = tier;
+            ret->op = opTiers[tier].ev_fun;
+            ret->subexprs.push_back(sub);
+            ret->subtypes.push_back(0);
+        }
+
+        pos += eat_whitespace(data,&segs,pos);
         sub1 = parseExpr(pos, tier+1);
         if(!sub1) THROW("Expected expression after '%s'", opTiers[tier].ops[index]);
         ret->subexprs.push_back(sub1);
         ret->subtypes.push_back(index);
     }
-    if(ret->subexprs.size()==1) {
-        delete ret;
-        return sub;
-    }
+    if(!ret) return sub;
     return ret;
 }
 
+bool LoadParseCache(ConfyFile &f);
+bool StoreParseCache(ConfyFile &f);
+
+// path of an included file, relative to the including file's directory
+std::string IncludePath(const std::string &fpath, const std::string &fname) {
+    if(std::filesystem::path(fname).is_absolute()) return fname;
+    std::string abspath = fpath;
+    if(abspath.length()) abspath+="/";
+    abspath+=fname;
+    return abspath;
+}
+
+// load and parse f.fname; touches no shared state, so that it can run on any
+// thread, and counts into st
+bool ParseFile(ConfyFile &f, ConfyStats &st) {
+    long faults0 = page_faults(), rss0 = current_rss();
+    const std::string &fname = f.fname;
+
+    f.fpath = std::filesystem::path(fname).parent_path();
+
+    /* map or read file contents, unless that was done in a batch */
+    if(!f.buf.data && !LoadFileBuffer(fname, &f.buf))
+        return false;
+    f.data = f.buf.data;
+    f.size = f.buf.size;
+    f.disk.Reset(f.buf);
+    if(f.buf.maplen) ++st.files_mapped;
+    else ++st.files_read;
+    st.bytes_loaded += f.size;
+
+    if(LoadParseCache(f)) {
+        ++st.cache_hits;
+    } else {
+        ++st.cache_misses;
+        /* look for confy-setup block */
+        if(!f.parseSetup()) {
+            report_error("ERROR: Could not find confy-setup block in '%s'.\n",fname.c_str());
+            return false;
+        }
+        double t0 = ConfyStats::Now();
+        bool coloured = f.colourBlocks();
+        st.colour_secs += ConfyStats::Now()-t0;
+        st.colour_bytes += f.size;
+        if(!coloured) {
+            report_error("ERROR: Could not segment '%s' according to comment types.\n",fname.c_str());
+            return false;
+        }
+        if(!f.parseBody()) {
+            report_error("ERROR: Failed to parse '%s'.\n",fname.c_str());
+            return false;
+        }
+        if(StoreParseCache(f)) ++st.cache_writes;
+    }
+    // only metacode is looked at again before saving; for huge files, leave
+    // the rest to be paged back in while streaming out
+    if(f.size >= (offs_t)FileBuffer::EVICT_CHUNK) f.buf.Evict(f.data, f.size);
+    st.arena_bytes += f.arena.bytes;
+    st.load_faults += page_faults()-faults0;
+    st.load_rss += current_rss()-rss0;
+    return true;
+}
+
+// a file being loaded and parsed ahead of its execution
+struct ParseJob {
+    ConfyFile f;
+    bool ok = false;
+    std::string errors; // reported when the file is used
+    ConfyStats st;      // merged in when the file is used
+    std::atomic<int> state { 0 }; // queued, running, done
+    std::mutex m;
+    std::condition_variable cv;
+};
 
 struct ConfyState {
     std::vector<ConfyFile> files;
 
-    std::map<std::string, ConfyVar> vars;
-    std::vector<std::string> varNames; 
+    std::vector<ConfyVar> vars; // by symbol slot
+    std::vector<int> varSlots;  // defined variables in order of definition
 
-    // -1 if not found
-    int FindFile(std::string fname) {
-        for(int i=0; i<files.size(); ++i) {
-            if(files[i].fname == fname) {
-                return i;
-            }
+    // long texts and literals of values set from outside, which no file owns
+    std::unordered_set<std::string> texts;
+
+    // v with what it refers to, if anything, kept for as long as the state
+    ConfyVal Keep(ConfyVal v) {
+        if(v.len==ConfyVal::LONG) v.Refer(*texts.emplace(v.Stored()).first);
+        return v;
+    }
+
+    // NULL if not defined
+    ConfyVar *Var(int slot) {
+        if(slot<0 || slot>=vars.size() || !vars[slot].defined) return NULL;
+        return &vars[slot];
+    }
+    ConfyVar *Var(std::string_view name) {
+        return Var(symbols.Find(name));
+    }
+
+    ExecTracker exec;
+
+    // execute a statement, or skip it if nothing it depends on changed
+    ConfyVal Run(SyntaxNode *n, int fid, bool enable) {
+        if(!exec.depth || n->Untracked()) return n->Execute(fid,this,enable);
+        if(!n->memo) n->memo = files[fid].arena.make<ExecMemo>();
+        ExecMemo &m = *n->memo;
+        bool same = exec.Reach(m);
+        if(exec.CanSkip(m, same, enable)) {
+            exec.Replay(m, vars);
+            ++stats.exec_skipped;
+            return m.ret;
         }
-        return -1;
+        exec.Enter(m, same);
+        ConfyVal ret = n->Execute(fid,this,enable);
+        exec.Leave(m, same, enable, ret, vars);
+        ++stats.exec_run;
+        return ret;
     }
 
-    bool LoadAndParseFile(std::string fname) {
-        int i;
-        if((i=FindFile(fname))>=0) {
-            files[i].s->Execute(i,this,true);
-            return true;
+    // files are parsed on the pool as soon as some parsed file includes them,
+    // but only executed, in order, when LoadAndParseFile gets to them
+    std::mutex jobs_m;
+    std::map<std::string, std::shared_ptr<ParseJob>> jobs;
+
+    // loaded files by every name they were asked for by, and by device and
+    // inode, so that other paths to the same file find it too
+    struct InodeHash {
+        size_t operator()(const std::pair<uint64_t,uint64_t> &k) const { return k.first*0x9E3779B97F4A7C15ull ^ k.second; }
+    };
+    std::unordered_map<std::string, int> file_names;
+    std::unordered_map<std::pair<uint64_t,uint64_t>, int, InodeHash> file_inodes;
+
+    std::vector<int> running; // files being executed, innermost last
+
+    // -1 if not loaded
+    int FindFile(const std::string &fname) {
+        auto it = file_names.find(fname);
+        if(it!=file_names.end()) return it->second;
+        struct stat sb;
+        if(stat(fname.c_str(), &sb)) return -1;
+        auto jt = file_inodes.find({ (uint64_t)sb.st_dev, (uint64_t)sb.st_ino });
+        if(jt==file_inodes.end()) return -1;
+        file_names[fname] = jt->second;
+        return jt->second;
+    }
+
+    // schedule fname for loading unless that has already happened
+    std::shared_ptr<ParseJob> Prefetch(const std::string &fname) {
+        std::lock_guard<std::mutex> lk(jobs_m);
+        std::shared_ptr<ParseJob> &job = jobs[fname];
+        if(!job) {
+            job = std::make_shared<ParseJob>();
+            job->f.fname = fname;
+            pool.Submit([this, job] { RunJob(*job); });
         }
+        return job;
+    }
 
-        auto size = std::filesystem::file_size(fname);
-        if(size<=0) {
-            fprintf(stderr,"ERROR: File '%s' not found.\n",fname.c_str());
-            return false;
+    // schedule several files for loading; with io_uring, those not seen
+    // before are read here in one batch before they are handed out
+    void PrefetchAll(const std::vector<std::string> &fnames) {
+        std::vector<std::shared_ptr<ParseJob>> fresh;
+        {
+            std::lock_guard<std::mutex> lk(jobs_m);
+            for(auto &fname : fnames) {
+                std::shared_ptr<ParseJob> &job = jobs[fname];
+                if(job) continue;
+                job = std::make_shared<ParseJob>();
+                job->f.fname = fname;
+                job->state = 1; // running from here on
+                fresh.push_back(job);
+            }
+        }
+        if(fresh.size()>1 && io_batched()) {
+            std::vector<std::string> names;
+            for(auto &job : fresh) names.push_back(job->f.fname);
+            std::vector<FileBuffer> bufs;
+            LoadFileBuffers(names, bufs);
+            for(size_t i=0;i<fresh.size();++i) fresh[i]->f.buf = std::move(bufs[i]);
         }
+        for(auto &job : fresh) pool.Submit([this, job] { FinishJob(*job); });
+    }
 
-        files.push_back(ConfyFile());
-        ConfyFile &f = files.back();
+    void RunJob(ParseJob &job) {
+        int queued = 0;
+        if(!job.state.compare_exchange_strong(queued, 1)) return; // someone else got to it
+        FinishJob(job);
+    }
 
-        f.size = size;
-        f.fname = fname;
-        f.fpath = std::filesystem::path(fname).parent_path();
+    void FinishJob(ParseJob &job) {
+        error_sink = &job.errors;
+        job.ok = ParseFile(job.f, job.st);
+        error_sink = NULL;
+        if(job.ok) {
+            std::vector<std::string> names;
+            for(auto &inc : job.f.includes) names.push_back(IncludePath(job.f.fpath, inc));
+            PrefetchAll(names);
+        }
+        {
+            std::lock_guard<std::mutex> lk(job.m);
+            job.state = 2;
+        }
+        job.cv.notify_all();
+    }
 
+    // index of fname in files, loading it if needed; -1 on failure
+    int LoadFile(const std::string &fname) {
+        int i;
+        if((i=FindFile(fname))>=0) return i;
+
+        // parse it here unless a worker already started on it
+        std::shared_ptr<ParseJob> job = Prefetch(fname);
+        RunJob(*job);
+        {
+            std::unique_lock<std::mutex> lk(job->m);
+            job->cv.wait(lk, [&] { return job->state==2; });
+        }
 
-        /* read file contents */
-        FILE *fl = fopen(fname.c_str(),"rb");
-        if(!fl) {
-            fprintf(stderr,"ERROR: Could not open file '%s'.\n",fname.c_str());
-            files.pop_back();
-            return false;
+        fputs(job->errors.c_str(), stderr);
+        stats.Merge(job->st);
+        if(!job->ok) {
+            // a later include of the same file tries again
+            std::lock_guard<std::mutex> lk(jobs_m);
+            jobs.erase(fname);
+            return -1;
         }
-        f.data = (char*)malloc(size+1);
-        if(!fread(f.data,size,1,fl)) {
-            fprintf(stderr,"ERROR: Failed to read from '%s'.\n",fname.c_str());
-            free(f.data);
-            files.pop_back();
-            return false;
+        // another path to a file loaded already
+        const FileBuffer &b = job->f.buf;
+        auto at = file_inodes.find({ b.dev, b.ino });
+        if(at!=file_inodes.end()) {
+            file_names[fname] = at->second;
+            return at->second;
         }
-        f.data[size]=0;
-        fclose(fl);
-        /* init mask for parsing */
-        f.mask = (char*)malloc(size+1);
-        memset(f.mask, 0, size+1);
+        files.push_back(std::move(job->f));
+        i = files.size()-1;
+        file_names[fname] = i;
+        file_inodes[{ files[i].buf.dev, files[i].buf.ino }] = i;
+        return i;
+    }
 
-        /* look for confy-setup block */
-        if(!f.parseSetup()) {
-            fprintf(stderr,"ERROR: Could not find confy-setup block in '%s'.\n",fname.c_str());
-            free(f.data);
-            free(f.mask);
-            files.pop_back();
+    bool LoadAndParseFile(std::string fname) {
+        int i = LoadFile(fname);
+        if(i<0) return false;
+        Execute(i);
+        return true;
+    }
+
+    // run file fid for the include statement being executed. A file that
+    // already ran from some include in this pass is not run again if
+    // nothing it read was written since; its effects are replayed instead.
+    // False for an include cycle
+    bool IncludeFile(int fid) {
+        ConfyFile &f = files[fid];
+        auto at = std::find(running.begin(), running.end(), fid);
+        if(at!=running.end()) {
+            std::string chain;
+            for(; at!=running.end(); ++at) chain += files[*at].fname + " -> ";
+            report_error("ERROR: Include cycle: %s%s\n", chain.c_str(), f.fname.c_str());
             return false;
         }
-        if(!f.colourBlocks()) {
-            fprintf(stderr,"ERROR: Could not segment '%s' according to comment types.\n",fname.c_str());
-            free(f.data);
-            free(f.mask);
-            files.pop_back();
-            return false;
+        if(f.run_pass==exec.pass && f.run_memo && exec.CanRepeat(*f.run_memo, f.run_start)) {
+            exec.Replay(*f.run_memo, vars);
+            ++stats.exec_repeats;
+            return true;
         }
-        if(!f.parseBody()) {
-            fprintf(stderr,"ERROR: Failed to parse '%s'.\n",fname.c_str());
-            free(f.data);
-            free(f.mask);
-            files.pop_back();
-            return false;
+        if(exec.depth>1) {
+            f.run_pass = exec.pass;
+            f.run_memo = exec.Top().memo;
+            f.run_start = exec.clock;
         }
-        f.s->Execute(files.size()-1,this,true);
-        //printf("== Debug render: ==\n%s", f.s->Render(&f,this).c_str());
-
+        Execute(fid);
         return true;
     }
 
-    bool SaveFile(int fid) 
-    {
-        free(files[fid].data);
-        
-        std::string data = files[fid].s->Render(fid,this);
-        files[fid].data = (char*)malloc(data.length()+1);
-        memcpy(files[fid].data, data.c_str(), data.length()+1);
+    // run file fid, as a run of its own unless it is being included
+    void Execute(int fid) {
+        bool top = !exec.depth;
+        if(top) exec.BeginPass(fid);
+        exec.FileRun(fid);
+        running.push_back(fid);
+        files[fid].s->Execute(fid,this,true);
+        running.pop_back();
+        if(top) exec.EndPass(vars);
+    }
 
-        FILE *fl = fopen(files[fid].fname.c_str(),"wb");
-        if(!fl) {
-            fprintf(stderr,"ERROR: Could not open file '%s' for writing.\n",files[fid].fname.c_str());
-            return false;
+    // run file fid again after variables were changed from outside, which
+    // is reported through exec.Edit
+    void Update(int fid) {
+        if(!exec_check || !exec_incremental) {
+            Execute(fid);
+            return;
         }
-        if(!fwrite(files[fid].data,data.length(),1,fl)) {
-            fprintf(stderr,"ERROR: Failed to write to '%s'.\n",files[fid].fname.c_str());
-            return false;
+        // compare with a full run from the same state, which is kept
+        std::vector<ConfyVar> before = vars;
+        std::vector<int> before_slots = varSlots;
+        exec.keep_undo = true;
+        Execute(fid);
+        exec.keep_undo = false;
+        std::vector<ConfyVar> inc = vars;
+        std::string inc_out = RenderAll();
+
+        vars = before;
+        varSlots = before_slots;
+        exec.Undo();
+        exec.skip = false;
+        Execute(fid);
+        exec.skip = true;
+
+        for(int i=0; i<vars.size() || i<inc.size(); ++i) {
+            bool d1 = i<inc.size() && inc[i].defined, d2 = i<vars.size() && vars[i].defined;
+            if(d1!=d2 || (d1 && (!inc[i].val.Same(vars[i].val) || inc[i].hidden!=vars[i].hidden)))
+                fprintf(stderr, "EXEC MISMATCH: $%s is %s after incremental run, %s after full run\n", symbols.Name(i).c_str(),
+                        d1 ? inc[i].val.Render().c_str() : "undefined", d2 ? vars[i].val.Render().c_str() : "undefined");
+        }
+        if(inc_out != RenderAll())
+            fprintf(stderr, "EXEC MISMATCH: output differs after incremental run\n");
+    }
+
+    std::string RenderAll() {
+        std::string ret;
+        for(int i=0; i<files.size(); ++i) ret += files[i].s->Output(i, this);
+        return ret;
+    }
+
+    enum SaveResult { SAVE_FAILED, SAVE_UNCHANGED, SAVE_WRITTEN };
+
+    // how a file is to be saved
+    struct SavePlan {
+        int fid;
+        bool patch = false;
+        size_t size = 0;  // of the output
+        std::vector<std::pair<size_t,std::string>> ranges; // to patch
+    };
+
+    // files at least this large are patched in place when the ranges that
+    // differ, plus any end cut off, are at most a PATCH_SHARE-th of them and
+    // nothing else in the save changes
+    static const size_t PATCH_SHARE = 8, PATCH_MAX_KEPT = 64*1024*1024;
+    size_t patch_min_size = 1024*1024;
+
+    // whether file fid was changed in place on disk since it was loaded or
+    // last saved, given its stat. Its buffer is then still mapped from the
+    // same inode, so the AST no longer refers to what was parsed: pages past
+    // a cut read as zeros or fault, others may show the new contents. A file
+    // replaced by another, or rewritten by us, leaves the mapping intact
+    bool ChangedUnderMapping(int fid, const struct statx *sx) {
+        ConfyFile &f = files[fid];
+        if(!f.buf.maplen || f.rewritten || !sx || f.disk.mtime_ns<0) return false;
+        if(makedev(sx->stx_dev_major, sx->stx_dev_minor)!=f.buf.dev || sx->stx_ino!=f.buf.ino) return false;
+        return sx->stx_size!=f.disk.size || statx_mtime_ns(*sx)!=f.disk.mtime_ns;
+    }
+
+    // how the file's output compares with what it holds, given its stat if
+    // that worked; false if it is already that. A file changed on disk
+    // since is always rewritten
+    bool PlanSave(int fid, const struct statx *sx, SavePlan &plan) {
+        ConfyFile &f = files[fid];
+        plan.fid = fid;
+        if(!f.buf.regular || !sx || !S_ISREG(sx->stx_mode) || sx->stx_size!=f.disk.size ||
+           statx_mtime_ns(*sx)!=f.disk.mtime_ns)
+            return true;
+        if(f.rewritten) {
+            HashSink h;
+            f.s->Stream(fid, this, h);
+            return h.h.size!=f.disk.size || h.h.Final()!=f.rewritten_hash;
+        }
+        // the patches are kept in memory, so they are limited as a whole
+        size_t limit = 0;
+        if(f.disk.size>=patch_min_size && f.disk.patched<PATCH_MAX_KEPT)
+            limit = std::min(f.disk.size/PATCH_SHARE, PATCH_MAX_KEPT-f.disk.patched);
+        DiffSink d(f.disk, f.buf, limit);
+        f.s->Stream(fid, this, d);
+        d.Finish();
+        if(d.Same()) return false;
+        if(!d.over) {
+            plan.patch = true;
+            plan.size = d.size;
+            plan.ranges = std::move(d.ranges);
         }
-        fclose(fl);
         return true;
     }
+
+    // save the files as one commit: the changed ones are written next to
+    // their targets and only replace them once all have been written and
+    // synced, so that either all or none of them change. A large file with
+    // few changed bytes is patched in place instead, but only when it is the
+    // one file the save changes, as a patch can't be taken back. Files that
+    // already hold their output are left alone, keeping their mtime. Returns
+    // the number of files written, or -1 if there was an error
+    int SaveFiles(const std::vector<int> &fids, int *unchanged = NULL) {
+        std::vector<struct statx> stx;
+        StatFiles(fids, stx);
+        for(size_t i=0;i<fids.size();++i) {
+            if(stx[i].stx_mask && ChangedUnderMapping(fids[i], &stx[i])) {
+                report_error("ERROR: '%s' was changed on disk since it was loaded; load it again before saving.\n",
+                             files[fids[i]].fname.c_str());
+                return -1;
+            }
+        }
+        std::vector<SavePlan> plans;
+        for(size_t i=0;i<fids.size();++i) {
+            SavePlan plan;
+            if(PlanSave(fids[i], stx[i].stx_mask ? &stx[i] : NULL, plan)) plans.push_back(std::move(plan));
+            else ++stats.files_unchanged;
+        }
+        if(unchanged) *unchanged = fids.size()-plans.size();
+        // a patch can't be taken back once done, so files are only patched
+        // when nothing else changes with them; otherwise a failure would
+        // leave the save half done
+        if(plans.size()>1)
+            for(auto &plan : plans) {
+                plan.patch = false;
+                plan.ranges.clear();
+            }
+
+        // the loaded buffers stay alive, since the AST refers into them, and
+        // the output is streamed from there rather than rendered into memory
+        // first. Huge files go one at a time, so that what was written of
+        // them can be dropped as it goes; the rest are written in batches
+        std::vector<Replacement> rs;
+        std::vector<HashStream> hashes(plans.size());
+        std::vector<size_t> batch;
+        std::vector<std::string> names;
+        for(size_t k=0;k<plans.size();++k) {
+            if(plans[k].patch) continue;
+            int fid = plans[k].fid;
+            ConfyFile &f = files[fid];
+            if(f.buf.size<FileBuffer::EVICT_CHUNK) {
+                batch.push_back(k);
+                names.push_back(f.fname);
+                continue;
+            }
+            HashSink h;
+            rs.emplace_back();
+            bool ok = WriteReplacement(f.fname, &f.buf, [&] (Sink &w) {
+                h.next = &w;
+                f.s->Stream(fid, this, h);
+            }, rs.back());
+            if(!ok) {
+                rs.pop_back();
+                DiscardReplacements(rs);
+                return -1;
+            }
+            hashes[k] = h.h;
+        }
+        if(batch.size()) {
+            std::vector<Replacement> brs;
+            bool ok = WriteReplacements(names, [&] (size_t i, Sink &w) {
+                HashSink h(&w);
+                int fid = plans[batch[i]].fid;
+                files[fid].s->Stream(fid, this, h);
+                hashes[batch[i]] = h.h;
+            }, brs, &pool);
+            rs.insert(rs.end(), brs.begin(), brs.end());
+            if(!ok) {
+                DiscardReplacements(rs);
+                return -1;
+            }
+        }
+
+        std::vector<std::string> patched;
+        for(auto &plan : plans) {
+            if(!plan.patch) continue;
+            ConfyFile &f = files[plan.fid];
+            bool ok = PatchFile(f.fname, f.buf, plan.ranges, f.disk.size, plan.size);
+            // what the file now holds is uncertain, so it is rewritten next time
+            f.disk.mtime_ns = -1;
+            if(!ok) {
+                DiscardReplacements(rs);
+                return -1;
+            }
+            for(auto &[off, bytes] : plan.ranges) {
+                f.disk.Apply(off, bytes);
+                stats.bytes_written += bytes.size();
+            }
+            f.disk.Truncate(plan.size);
+            patched.push_back(f.fname);
+            ++stats.files_patched;
+        }
+        if(!CommitReplacements(rs, patched, &pool)) return -1;
+
+        std::vector<int> written;
+        for(auto &plan : plans) written.push_back(plan.fid);
+        StatFiles(written, stx);
+        for(size_t k=0;k<plans.size();++k) {
+            ConfyFile &f = files[plans[k].fid];
+            if(!plans[k].patch) {
+                f.rewritten = true;
+                f.rewritten_hash = hashes[k].Final();
+                f.disk.Reset(f.buf);
+                f.disk.size = hashes[k].size;
+                stats.bytes_written += hashes[k].size;
+            }
+            f.disk.mtime_ns = stx[k].stx_mask ? statx_mtime_ns(stx[k]) : -1;
+        }
+        stats.files_written += plans.size();
+        return plans.size();
+    }
+
+    // stat the files in one batch; the stx_mask of those that failed is 0
+    void StatFiles(const std::vector<int> &fids, std::vector<struct statx> &stx) {
+        stx.assign(fids.size(), {});
+        std::vector<IoOp> ops(fids.size());
+        for(size_t i=0;i<fids.size();++i) {
+            ops[i].kind = IO_STATX;
+            ops[i].fd = AT_FDCWD;
+            ops[i].path = files[fids[i]].fname.c_str();
+            ops[i].buf = &stx[i];
+        }
+        RunIoOps(ops, &pool);
+        for(size_t i=0;i<fids.size();++i)
+            if(ops[i].res) stx[i].stx_mask = 0;
+    }
+
+    SaveResult SaveFile(int fid) {
+        int written = SaveFiles({fid});
+        return written<0 ? SAVE_FAILED : written ? SAVE_WRITTEN : SAVE_UNCHANGED;
+    }
+
+    int SaveAll(int *unchanged = NULL) {
+        std::vector<int> fids(files.size());
+        for(int i=0;i<files.size();++i) fids[i] = i;
+        return SaveFiles(fids, unchanged);
+    }
+
+    // the workers parsing files and doing I/O; last, so that it is stopped
+    // before the rest goes away
+    WorkPool pool;
 };
 
 #include "ast_impl.hpp"
+#include "bytecode.hpp"
+#include "cache.hpp"
 
+#include "batch.hpp"
+#include "serve.hpp"
 #include "ui.hpp"
 
 int main(int argc, char* argv[])
 {
+    // strip global flags before positional arguments
+    const char *serve_root=NULL, *socket_path=NULL;
+    bool client_mode=false;
+    int nargc=0;
+    for(int i=0;i<argc;++i) {
+        if(!strcmp(argv[i], "--stats")) stats.enabled=true;
+        else if(!strcmp(argv[i], "--no-cache")) cache_enabled=false;
+        else if(!strcmp(argv[i], "--tree-eval")) eval_mode=EVAL_TREE;
+        else if(!strcmp(argv[i], "--check-eval")) eval_mode=EVAL_CHECK;
+        else if(!strcmp(argv[i], "--full-exec")) exec_incremental=false;
+        else if(!strcmp(argv[i], "--check-exec")) exec_check=true;
+        else if(!strcmp(argv[i], "--no-fsync")) save_fsync=false;
+        else if(!strcmp(argv[i], "--no-uring")) io_uring_enabled=false;
+        else if(!strcmp(argv[i], "--serve") && i+1<argc) serve_root=argv[++i];
+        else if(!strcmp(argv[i], "--socket") && i+1<argc) socket_path=argv[++i];
+        else if(!strcmp(argv[i], "--client")) client_mode=true;
+        else argv[nargc++]=argv[i];
+    }
+    argc=nargc;
+    atexit([] { stats.Report(); });
+
+    std::string sock = socket_path ? socket_path : default_socket();
+    if(serve_root) return serve(serve_root, sock.c_str());
+    if(client_mode) return client(sock.c_str(), argc-1, argv+1);
+
     ConfyState st;
     if(argc>1) {
         if(!st.LoadAndParseFile(argv[1]))
             return -3;
     }
-    if(argc>3) {
+    if(argc>2 && !strcmp(argv[2], "batch")) {
+        FILE *in = stdin;
+        if(argc>3 && strcmp(argv[3], "-") && !(in = fopen(argv[3], "r"))) {
+            fprintf(stderr,"Could not open '%s'\n", argv[3]);
+            return -1;
+        }
+        int failed = batch(st, in);
+        if(in!=stdin) fclose(in);
+        return failed ? -1 : 0;
+    } else if(argc>3) {
         if(!strcmp(argv[2], "get")) {
-            if(st.vars.count(argv[3])) {
-                printf("%s\n",st.vars[argv[3]].val.Render().c_str());
+            if(ConfyVar *var = st.Var(argv[3])) {
+                printf("%s\n",var->val.Render().c_str());
                 return 0;
             } else {
                 fprintf(stderr,"Variable '%s' not found\n", argv[3]);
                 return -1;
             }
         } else if(!strcmp(argv[2], "set") && argc>4) {
-            if(st.vars.count(argv[3])) {
-                // prepare mask to parse value from argv[4]
-                int len = strlen(argv[3])+1, pos=0;
-                char *mask = (char*)malloc(len);
-                memset(mask,0,len);
-                ConfyVal *newv = parseValue(argv[4], mask, pos);
-                if(!newv) {
+            if(ConfyVar *var = st.Var(argv[3])) {
+                offs_t pos=0;
+                ConfyVal newv;
+                Arena parsed; // until newv is kept by the state
+                if(!parseValue(argv[4], NULL, pos, newv, parsed)) {
                     fprintf(stderr,"Couldn't parse value '%s'!\n",argv[4]);
                     return -2;
                 }
 
                 // replace value in state
-                ConfyType oldt = st.vars[argv[3]].val.t;
-                st.vars[argv[3]].val = *newv;
-                st.vars[argv[3]].val.t = oldt; // coerce to definitional type
+                var->val.CoerceFrom(st.Keep(newv)); // coerce to definitional type
+                st.exec.Edit(symbols.Find(argv[3]));
 
                 // reevaluate script and save
-                st.files[st.vars[argv[3]].fl].s->Execute(st.vars[argv[3]].fl, &st, true);
-                st.SaveFile(st.vars[argv[3]].fl);
-                printf("== Debug render: ==\n%s", st.files[st.vars[argv[3]].fl].s->Render(st.vars[argv[3]].fl, &st).c_str());
+                int fl = var->fl;
+                st.Update(fl);
+                if(st.SaveFile(fl)==ConfyState::SAVE_UNCHANGED)
+                    printf("== '%s' unchanged, not written ==\n", st.files[fl].fname.c_str());
+                printf("== Debug render: ==\n");
+                fflush(stdout);
+                FileWriter out(STDOUT_FILENO, &st.files[fl].buf);
+                st.files[fl].s->Stream(fl, &st, out);
+                out.Flush();
                 return 0;
             } else {
                 fprintf(stderr,"Variable '%s' not found\n", argv[3]);
@@ -0,0 +1,331 @@
+// incremental re-execution
+//
+// Every statement (child of a Seq) keeps a memo of its last execution: the
+// variables it read, the ones it wrote or hid, and their state afterwards.
+// When a file is run again, a statement whose reads are all unchanged since
+// the previous run at the same point is skipped and its writes are replayed
+// instead. "Changed" is the set of slots whose value differs from the
+// previous run at the current point; it starts out as what that run changed
+// plus the variables edited since, and is kept up to date as statements
+// execute or are skipped.
+//
+// A memo is only trusted if it was taken at the same place in the previous
+// execution of the enclosing statement. Statements reached more than once
+// (template bodies, files included from several places) or for the first
+// time run normally, and nothing else in the enclosing statement is skipped
+// after them; its exit then recomputes the changed set from its old and new
+// writes.
+
+bool exec_incremental = true; // --full-exec turns it off
+bool exec_check = false;      // compare every incremental run with a full one
+
+struct ExecMemo {
+    uint64_t id = 0;     // last execution
+    uint64_t parent = 0; // execution of the enclosing statement it was last reached in
+    bool enable = false;
+    bool again = false;  // reached more than once in that one
+    bool pinned = false; // never skipped
+    ConfyVal ret;
+    std::vector<int> reads, writes, hides; // sorted slots
+    std::vector<ConfyVal> wvals;           // state of writes afterwards
+    std::vector<uint8_t> wdef, hvals;      // and of hides
+    // files run, with the last run of each; their nodes are only as this
+    // statement left them if nothing has run them since
+    std::vector<std::pair<int,uint64_t>> files;
+};
+
+struct ExecFrame {
+    ExecMemo *memo = NULL;
+    uint64_t id = 0;
+    uint64_t old_id = 0;       // previous execution at this place, 0 if unknown
+    bool tainted = false;  // something ran whose previous effects are unknown
+    bool pinned = false;
+    std::vector<int> reads, writes, hides;
+    std::vector<std::pair<int,uint64_t>> files;
+};
+
+static void sort_unique(std::vector<int> &v) {
+    std::sort(v.begin(), v.end());
+    v.erase(std::unique(v.begin(), v.end()), v.end());
+}
+
+struct ExecTracker {
+    bool skip = true;
+    // innermost statement at depth-1, none between runs; frames above depth
+    // are kept to reuse their storage
+    std::vector<ExecFrame> frames;
+    int depth = 0;
+    uint64_t next_id = 0;
+    int root = -1;        // file the last run started at
+    uint64_t root_id = 0;
+
+    // slots that differ from the previous run at this point
+    std::vector<uint8_t> dirty;
+    std::vector<int> dirty_list; // may hold slots since cleaned
+    int ndirty = 0;
+
+    // state at the start of this run of the slots it wrote
+    int pass = 0;
+    std::vector<int> start_pass;
+    std::vector<ConfyVal> start_val;
+    std::vector<uint8_t> start_def;
+    std::vector<int> touched;
+
+    std::vector<int> edited; // changed from outside since the last run
+
+    std::vector<uint64_t> file_runs; // by file
+
+    // time of the last write to each slot, on a clock of writes
+    uint64_t clock = 0;
+    std::vector<uint64_t> wtime;
+
+    // node state changed by a run that is to be compared with a full one,
+    // so that the latter can start from the same state
+    bool keep_undo = false;
+    std::vector<std::pair<VarDef*,ConfyVar>> undo;
+
+    static bool SameState(const std::vector<ConfyVar> &vars, int slot, bool def, const ConfyVal &val) {
+        bool cur = slot<vars.size() && vars[slot].defined;
+        if(cur!=def) return false;
+        return !def || vars[slot].val.Same(val);
+    }
+
+    void SetDirty(int slot, bool d) {
+        if(slot>=dirty.size()) dirty.resize(slot+1);
+        if(d && !dirty[slot]) {
+            dirty[slot] = 1;
+            dirty_list.push_back(slot);
+            ++ndirty;
+        } else if(!d && dirty[slot]) {
+            dirty[slot] = 0;
+            --ndirty;
+        }
+    }
+    void ClearDirty() {
+        for(int s : dirty_list) dirty[s] = 0;
+        dirty_list.clear();
+        ndirty = 0;
+    }
+
+    // whether any of the sorted slots changed
+    bool AnyDirty(const std::vector<int> &slots) {
+        if(!ndirty) return false;
+        if(dirty_list.size() > 2*ndirty+64) {
+            std::vector<int> live;
+            for(int s : dirty_list) if(dirty[s]) live.push_back(s);
+            sort_unique(live);
+            dirty_list.swap(live);
+        }
+        if(slots.size() <= dirty_list.size()) {
+            for(int s : slots)
+                if(s<dirty.size() && dirty[s]) return true;
+        } else {
+            for(int s : dirty_list)
+                if(dirty[s] && std::binary_search(slots.begin(), slots.end(), s)) return true;
+        }
+        return false;
+    }
+
+    // hooks for the nodes; writes are noted before the variable is modified
+    ExecFrame &Top() { return frames[depth-1]; }
+    ExecFrame &Push(uint64_t old_id) {
+        if(depth==frames.size()) frames.emplace_back();
+        ExecFrame &f = frames[depth++];
+        f.memo = NULL;
+        f.id = ++next_id;
+        f.old_id = old_id;
+        f.tainted = f.pinned = false;
+        f.reads.clear();
+        f.writes.clear();
+        f.hides.clear();
+        f.files.clear();
+        return f;
+    }
+
+    void Read(int slot) {
+        if(depth>1) Top().reads.push_back(slot);
+    }
+    void Write(int slot, const std::vector<ConfyVar> &vars) {
+        if(!depth) return;
+        if(depth>1) Top().writes.push_back(slot);
+        if(slot>=wtime.size()) wtime.resize(slot+1);
+        wtime[slot] = ++clock;
+        if(slot>=start_pass.size()) {
+            start_pass.resize(slot+1);
+            start_val.resize(slot+1);
+            start_def.resize(slot+1);
+        }
+        if(start_pass[slot]!=pass) {
+            start_pass[slot] = pass;
+            start_def[slot] = slot<vars.size() && vars[slot].defined;
+            if(start_def[slot]) start_val[slot] = vars[slot].val;
+            touched.push_back(slot);
+        }
+    }
+    void Hide(int slot) {
+        if(depth>1) Top().hides.push_back(slot);
+    }
+    // the current statement runs its parts in a different order than last
+    // time, so none of them is at the same place
+    void Reorder() {
+        if(depth>1) Top().old_id = 0;
+    }
+    // the current statement can't be skipped next time
+    void Pin() {
+        if(depth>1) Top().pinned = true;
+    }
+    void FileRun(int fid) {
+        if(fid>=file_runs.size()) file_runs.resize(fid+1);
+        file_runs[fid] = ++next_id;
+        if(depth>1) Top().files.emplace_back(fid, file_runs[fid]);
+    }
+    void Changing(VarDef *n) {
+        if(keep_undo) undo.emplace_back(n, n->v);
+    }
+    void Undo() {
+        for(size_t i=undo.size(); i--;) {
+            undo[i].first->v = undo[i].second;
+            undo[i].first->Changed();
+        }
+        undo.clear();
+    }
+    void Edit(int slot) {
+        edited.push_back(slot);
+    }
+
+    void BeginPass(int fid) {
+        ++pass;
+        depth = 0;
+        root_id = Push(fid==root ? root_id : 0).id;
+        root = fid;
+        for(int s : edited) SetDirty(s, true);
+        edited.clear();
+    }
+    void EndPass(const std::vector<ConfyVar> &vars) {
+        depth = 0;
+        // what this run changed is what the next one starts from
+        ClearDirty();
+        for(int s : touched)
+            if(!SameState(vars, s, start_def[s], start_val[s])) SetDirty(s, true);
+        touched.clear();
+    }
+
+    // the statement with memo m is about to be reached under the innermost
+    // frame; returns whether it is at the same place as last time
+    bool Reach(ExecMemo &m) {
+        ExecFrame &pf = Top();
+        bool same = false;
+        if(m.parent==pf.id) m.again = true;
+        else {
+            same = pf.old_id && !pf.tainted && m.parent==pf.old_id && !m.again;
+            m.again = false;
+            m.parent = pf.id;
+        }
+        if(!same) pf.tainted = true;
+        return same;
+    }
+
+    bool CanSkip(const ExecMemo &m, bool same, bool enable) {
+        if(!exec_incremental || !skip || !same || m.pinned || m.enable!=enable) return false;
+        for(auto &[fid, run] : m.files)
+            if(file_runs[fid]!=run) return false;
+        return !AnyDirty(m.reads);
+    }
+
+    // whether the statement recorded in m, which started at clock time
+    // since in this pass, would do the same if run again now: nothing it
+    // read was written since, itself included, and the files it ran haven't
+    // run again
+    bool CanRepeat(const ExecMemo &m, uint64_t since) {
+        if(!exec_incremental || !skip || m.pinned) return false;
+        for(auto &[fid, run] : m.files)
+            if(file_runs[fid]!=run) return false;
+        for(int s : m.reads)
+            if(s<wtime.size() && wtime[s]>since) return false;
+        return true;
+    }
+
+    // apply the recorded effects of a skipped statement
+    void Replay(const ExecMemo &m, std::vector<ConfyVar> &vars) {
+        for(int i=0;i<m.writes.size();++i) {
+            int s = m.writes[i];
+            Write(s, vars);
+            if(s>=vars.size()) vars.resize(s+1);
+            vars[s].defined = m.wdef[i];
+            vars[s].val = m.wvals[i];
+            SetDirty(s, false);
+        }
+        for(int i=0;i<m.hides.size();++i) {
+            Hide(m.hides[i]);
+            vars[m.hides[i]].hidden = m.hvals[i];
+        }
+        if(depth>1) {
+            ExecFrame &pf = Top();
+            pf.reads.insert(pf.reads.end(), m.reads.begin(), m.reads.end());
+            pf.files.insert(pf.files.end(), m.files.begin(), m.files.end());
+        }
+    }
+
+    void Enter(ExecMemo &m, bool same) {
+        Push(same ? m.id : 0).memo = &m;
+    }
+
+    // the statement that was entered has finished; record it in m
+    void Leave(ExecMemo &m, bool same, bool enable, const ConfyVal &ret, const std::vector<ConfyVar> &vars) {
+        ExecFrame &f = frames[--depth];
+        sort_unique(f.reads);
+        sort_unique(f.writes);
+        sort_unique(f.hides);
+        // last run of each file
+        std::stable_sort(f.files.begin(), f.files.end(), [] (auto &a, auto &b) { return a.first<b.first; });
+        size_t n = 0;
+        for(auto &e : f.files) {
+            if(n && f.files[n-1].first==e.first) f.files[n-1] = e;
+            else f.files[n++] = e;
+        }
+        f.files.resize(n);
+
+        // changed set after this statement: old and new writes compared with
+        // the state the previous run left them in here
+        if(same) {
+            size_t i=0, j=0;
+            while(i<m.writes.size() || j<f.writes.size()) {
+                if(j==f.writes.size() || (i<m.writes.size() && m.writes[i]<=f.writes[j])) {
+                    int s = m.writes[i];
+                    SetDirty(s, !SameState(vars, s, m.wdef[i], m.wvals[i]));
+                    if(j<f.writes.size() && f.writes[j]==s) ++j;
+                    ++i;
+                } else SetDirty(f.writes[j++], true);
+            }
+        } else {
+            for(int s : f.writes) SetDirty(s, true);
+        }
+
+        m.id = f.id;
+        m.enable = enable;
+        m.pinned = f.pinned;
+        m.ret = ret;
+        m.wvals.resize(f.writes.size());
+        m.wdef.resize(f.writes.size());
+        for(int i=0;i<f.writes.size();++i) {
+            int s = f.writes[i];
+            m.wdef[i] = s<vars.size() && vars[s].defined;
+            m.wvals[i] = m.wdef[i] ? vars[s].val : ConfyVal();
+        }
+        m.hvals.resize(f.hides.size());
+        for(int i=0;i<f.hides.size();++i) m.hvals[i] = vars[f.hides[i]].hidden;
+
+        if(depth>1) {
+            ExecFrame &pf = Top();
+            pf.reads.insert(pf.reads.end(), f.reads.begin(), f.reads.end());
+            pf.writes.insert(pf.writes.end(), f.writes.begin(), f.writes.end());
+            pf.hides.insert(pf.hides.end(), f.hides.begin(), f.hides.end());
+            pf.files.insert(pf.files.end(), f.files.begin(), f.files.end());
+            pf.pinned |= f.pinned;
+        }
+        m.reads = f.reads;
+        m.writes = f.writes;
+        m.hides = f.hides;
+        m.files = f.files;
+    }
+};
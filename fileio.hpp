@@ -0,0 +1,873 @@
+// file loading and saving
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <random>
+
+// contents of a loaded file, always followed by a NUL byte
+struct FileBuffer {
+    char *data = NULL;
+    size_t size = 0;
+    size_t maplen = 0; // nonzero if data is mapped rather than malloc'd
+
+    // huge files are passed over in pieces of this size, dropping each behind
+    static const size_t EVICT_CHUNK = 16*1024*1024;
+    bool regular = false;
+    int64_t mtime_ns = 0;
+    uint64_t dev = 0, ino = 0; // identify the file whatever path it was opened by
+    std::vector<std::pair<size_t,size_t>> kept; // sorted page ranges copied out of the mapping, see Detach
+
+    FileBuffer() = default;
+    FileBuffer(const FileBuffer&) = delete;
+    FileBuffer &operator=(const FileBuffer&) = delete;
+    FileBuffer(FileBuffer &&o) noexcept { *this = std::move(o); }
+    FileBuffer &operator=(FileBuffer &&o) noexcept {
+        if(this != &o) {
+            Release();
+            data = o.data; size = o.size; maplen = o.maplen;
+            regular = o.regular; mtime_ns = o.mtime_ns;
+            dev = o.dev; ino = o.ino;
+            kept = std::move(o.kept);
+            o.data = NULL; o.size = o.maplen = 0;
+        }
+        return *this;
+    }
+    ~FileBuffer() { Release(); }
+
+    // drop the resident pages wholly inside [p,p+n) of a mapped buffer; they
+    // are read back from the file if touched again, so detached ones stay
+    void Evict(const char *p, size_t n) const {
+        if(!maplen || !n) return;
+        size_t pagesz = sysconf(_SC_PAGESIZE);
+        size_t lo = (p-data+pagesz-1)/pagesz*pagesz, hi = (p+n-data)/pagesz*pagesz;
+        for(auto &[klo, khi] : kept) {
+            if(khi<=lo) continue;
+            if(klo>=hi) break;
+            if(klo>lo) madvise(data+lo, klo-lo, MADV_DONTNEED);
+            lo = khi;
+        }
+        if(hi>lo) madvise(data+lo, hi-lo, MADV_DONTNEED);
+    }
+
+    // make the pages of a mapped buffer that hold [off,off+n) private copies,
+    // so that they keep their contents when the file is changed in place.
+    // The page with the NUL is included if the range reaches the end
+    bool Detach(size_t off, size_t n) {
+        if(!maplen) return true;
+        size_t pagesz = sysconf(_SC_PAGESIZE);
+        size_t end = off+n;
+        if(end>=size) {
+            end = size+1;
+            off = std::min(off, size);
+        }
+        size_t lo = off/pagesz*pagesz, hi = std::min((end+pagesz-1)/pagesz*pagesz, maplen);
+        if(hi<=lo) return true;
+        if(mprotect(data+lo, hi-lo, PROT_READ|PROT_WRITE)) return false;
+        for(size_t pg=lo; pg<hi; pg+=pagesz) {
+            volatile char *c = data+pg;
+            *c = *c;
+        }
+        mprotect(data+lo, hi-lo, PROT_READ);
+        kept.emplace_back(lo, hi);
+        std::sort(kept.begin(), kept.end());
+        size_t k = 0;
+        for(auto &r : kept) {
+            if(k && kept[k-1].second>=r.first) kept[k-1].second = std::max(kept[k-1].second, r.second);
+            else kept[k++] = r;
+        }
+        kept.resize(k);
+        return true;
+    }
+
+    void Release() {
+        if(!data) return;
+        if(maplen) munmap(data, maplen);
+        else free(data);
+        data = NULL;
+        size = maplen = 0;
+    }
+};
+
+// map a regular file privately; the zero-filled tail of the last page, or an
+// extra anonymous page if the file fills its last page, provides the NUL
+static bool map_file(int fd, size_t size, FileBuffer *buf) {
+    size_t pagesz = sysconf(_SC_PAGESIZE);
+    size_t maplen = (size+1+pagesz-1)/pagesz*pagesz;
+    void *base = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED) return false;
+    if(mmap(base, size, PROT_READ, MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, maplen);
+        return false;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+    buf->data = (char*)base;
+    buf->size = size;
+    buf->maplen = maplen;
+    return true;
+}
+
+// read everything from fd, for pipes and other files that can't be mapped
+static bool read_file(int fd, FileBuffer *buf) {
+    size_t cap = 65536, len = 0;
+    char *data = (char*)malloc(cap+1);
+    while(1) {
+        if(len==cap) data = (char*)realloc(data, (cap*=2)+1);
+        ssize_t r = read(fd, data+len, cap-len);
+        if(r<0 && errno==EINTR) continue;
+        if(r<0) {
+            free(data);
+            return false;
+        }
+        if(!r) break;
+        len += r;
+    }
+    data[len] = 0;
+    buf->data = data;
+    buf->size = len;
+    buf->maplen = 0;
+    return true;
+}
+
+static int64_t stat_mtime_ns(const struct stat &sb) {
+    return (int64_t)sb.st_mtim.tv_sec*1000000000 + sb.st_mtim.tv_nsec;
+}
+
+static int64_t statx_mtime_ns(const struct statx &sx) {
+    return (int64_t)sx.stx_mtime.tv_sec*1000000000 + sx.stx_mtime.tv_nsec;
+}
+
+bool LoadFileBuffer(const std::string &fname, FileBuffer *buf) {
+    int fd = open(fname.c_str(), O_RDONLY|O_CLOEXEC);
+    if(fd<0) {
+        report_error("ERROR: Could not open file '%s'.\n",fname.c_str());
+        return false;
+    }
+    struct stat sb = {};
+    bool ok;
+    if(!fstat(fd, &sb) && S_ISREG(sb.st_mode) && sb.st_size>0)
+        ok = map_file(fd, sb.st_size, buf) || read_file(fd, buf);
+    else
+        ok = read_file(fd, buf);
+    close(fd);
+    if(!ok) {
+        report_error("ERROR: Failed to read from '%s'.\n",fname.c_str());
+        return false;
+    }
+    buf->regular = S_ISREG(sb.st_mode);
+    buf->mtime_ns = stat_mtime_ns(sb);
+    buf->dev = sb.st_dev;
+    buf->ino = sb.st_ino;
+    return true;
+}
+
+// load several files at once, with one batch each of opens, stats, reads
+// and closes; files larger than READ_MAX are mapped, as LoadFileBuffer
+// does. Those that fail or aren't regular files are left empty, for
+// LoadFileBuffer to try again and report
+static const size_t READ_MAX = 64*1024;
+
+void LoadFileBuffers(const std::vector<std::string> &fnames, std::vector<FileBuffer> &bufs) {
+    size_t n = fnames.size();
+    bufs.resize(n);
+    std::vector<IoOp> ops(n);
+    for(size_t i=0;i<n;++i) {
+        ops[i].kind = IO_OPENAT;
+        ops[i].path = fnames[i].c_str();
+        ops[i].flags = O_RDONLY|O_CLOEXEC;
+    }
+    RunIoOps(ops);
+    std::vector<int> fds(n);
+    for(size_t i=0;i<n;++i) fds[i] = ops[i].res;
+
+    std::vector<struct statx> stx(n);
+    std::vector<size_t> which; // file of each operation
+    ops.clear();
+    for(size_t i=0;i<n;++i) {
+        if(fds[i]<0) continue;
+        IoOp op { IO_STATX, fds[i], "" };
+        op.flags = AT_EMPTY_PATH;
+        op.buf = &stx[i];
+        ops.push_back(op);
+        which.push_back(i);
+    }
+    RunIoOps(ops);
+
+    std::vector<IoOp> reads;
+    std::vector<size_t> read_which;
+    for(size_t k=0;k<ops.size();++k) {
+        size_t i = which[k];
+        if(ops[k].res || !S_ISREG(stx[i].stx_mode)) continue;
+        FileBuffer &b = bufs[i];
+        size_t size = stx[i].stx_size;
+        if(size>READ_MAX) {
+            if(!map_file(fds[i], size, &b)) continue;
+        } else {
+            b.data = (char*)malloc(size+1);
+            b.data[size] = 0;
+            b.size = size;
+            if(size) {
+                IoOp op { IO_READ, fds[i] };
+                op.buf = b.data;
+                op.len = size;
+                reads.push_back(op);
+                read_which.push_back(i);
+            }
+        }
+        b.regular = true;
+        b.mtime_ns = statx_mtime_ns(stx[i]);
+        b.dev = makedev(stx[i].stx_dev_major, stx[i].stx_dev_minor);
+        b.ino = stx[i].stx_ino;
+    }
+    RunIoOps(reads);
+    for(size_t k=0;k<reads.size();++k)
+        if(reads[k].res!=(int)reads[k].len) bufs[read_which[k]].Release(); // changed meanwhile
+
+    ops.clear();
+    for(size_t i=0;i<n;++i) {
+        if(fds[i]<0) continue;
+        IoOp op { IO_CLOSE, fds[i] };
+        ops.push_back(op);
+    }
+    RunIoOps(ops);
+}
+
+// fast non-cryptographic 64-bit hash, for recognizing unchanged contents
+static uint64_t hash_update(uint64_t h, const char *p, size_t n) {
+    while(n>=8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h>>29;
+        p+=8; n-=8;
+    }
+    while(n--) h = (h ^ (unsigned char)*p++) * 0x100000001b3ull;
+    return h;
+}
+static uint64_t hash_final(uint64_t h) {
+    h ^= h>>32;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h>>29);
+}
+uint64_t hash_bytes(const char *p, size_t n, uint64_t h = 0x9E3779B97F4A7C15ull) {
+    return hash_final(hash_update(h^n, p, n));
+}
+
+// hash_bytes of a whole buffer, dropping huge files behind as it goes
+uint64_t hash_buffer(const FileBuffer &buf) {
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ buf.size;
+    for(size_t pos=0; pos<buf.size; pos+=FileBuffer::EVICT_CHUNK) {
+        size_t n = buf.size-pos < FileBuffer::EVICT_CHUNK ? buf.size-pos : FileBuffer::EVICT_CHUNK;
+        h = hash_update(h, buf.data+pos, n);
+        if(buf.size > FileBuffer::EVICT_CHUNK) buf.Evict(buf.data+pos, n);
+    }
+    return hash_final(h);
+}
+
+// hash of data arriving in pieces; the length is only known at the end, so
+// it mixes in last rather than first as in hash_bytes
+struct HashStream {
+    uint64_t h = 0x9E3779B97F4A7C15ull;
+    size_t size = 0;
+    char tail[8]; // the last size%8 bytes, not hashed yet
+
+    void Update(const char *p, size_t n) {
+        if(!n) return; // p may be null then, which memcpy must not see
+        size_t t = size%8;
+        size += n;
+        if(t) {
+            size_t k = n<8-t ? n : 8-t;
+            memcpy(tail+t, p, k);
+            p += k; n -= k;
+            if(t+k<8) return;
+            h = hash_update(h, tail, 8);
+        }
+        size_t whole = n & ~(size_t)7;
+        h = hash_update(h, p, whole);
+        memcpy(tail, p+whole, n-whole);
+    }
+    uint64_t Final() const {
+        return hash_final(hash_update(h, tail, size%8) ^ size);
+    }
+};
+
+// destination of rendered output, written piece by piece; pieces must stay
+// valid until the sink is done with them, see FileWriter
+struct Sink {
+    virtual void Write(const char *p, size_t n) = 0;
+    void Write(std::string_view sv) {
+        Write(sv.data(), sv.length());
+    }
+};
+
+// only counts, so that a string can be allocated once before filling it
+struct MeasureSink : Sink {
+    using Sink::Write;
+    size_t size = 0;
+    void Write(const char *p, size_t n) { size += n; }
+};
+
+struct StringSink : Sink {
+    using Sink::Write;
+    std::string &s;
+    StringSink(std::string &s) : s(s) {}
+    void Write(const char *p, size_t n) { s.append(p, n); }
+};
+
+// what a file holds while it is only patched in place: the loaded buffer,
+// with the ranges written since laid over it. Anything past the end of the
+// buffer is in a patch
+struct KnownContents {
+    std::map<size_t,std::string> patches; // by offset, apart from each other
+    size_t size = 0;
+    size_t patched = 0; // bytes in patches
+    int64_t mtime_ns = 0;
+
+    void Reset(const FileBuffer &b) {
+        patches.clear();
+        size = b.size;
+        patched = 0;
+        mtime_ns = b.mtime_ns;
+    }
+
+    // calls fn(off, p, n) for consecutive pieces covering [off,off+n)
+    template<class F> void Pieces(const FileBuffer &buf, size_t off, size_t n, F fn) const {
+        auto it = patches.upper_bound(off);
+        if(it!=patches.begin() && std::prev(it)->first+std::prev(it)->second.size()>off) --it;
+        while(n) {
+            const char *p;
+            size_t m;
+            if(it!=patches.end() && it->first<=off) {
+                size_t k = off-it->first;
+                p = it->second.data()+k;
+                m = std::min(n, it->second.size()-k);
+                ++it;
+            } else {
+                p = buf.data+off;
+                m = it!=patches.end() ? std::min(n, it->first-off) : n;
+            }
+            fn(off, p, m);
+            off += m; n -= m;
+        }
+    }
+
+    void Apply(size_t off, std::string_view bytes) {
+        size_t start = off, end = off+bytes.size();
+        std::string pre, post;
+        auto it = patches.upper_bound(off);
+        if(it!=patches.begin() && std::prev(it)->first+std::prev(it)->second.size()>=off) --it;
+        while(it!=patches.end() && it->first<=end) {
+            size_t pend = it->first+it->second.size();
+            if(it->first<off) {
+                start = it->first;
+                pre = it->second.substr(0, off-it->first);
+            }
+            if(pend>end) post = it->second.substr(end-it->first);
+            patched -= it->second.size();
+            it = patches.erase(it);
+        }
+        std::string &p = patches[start];
+        p = pre;
+        p += bytes;
+        p += post;
+        patched += p.size();
+        size = std::max(size, end);
+    }
+
+    void Truncate(size_t n) {
+        size = n;
+        while(patches.size()) {
+            auto last = std::prev(patches.end());
+            if(last->first+last->second.size()<=n) break;
+            patched -= last->second.size();
+            if(last->first>=n) patches.erase(last);
+            else {
+                last->second.resize(n-last->first);
+                patched += last->second.size();
+            }
+        }
+    }
+};
+
+// compares the output with known contents and collects the ranges that
+// differ, as long as they and any cut off end amount to no more than limit
+// bytes. Pieces taken from the loaded buffer at the same offset, as
+// unchanged blocks of the file are, match without being read
+struct DiffSink : Sink {
+    using Sink::Write;
+    const KnownContents &old;
+    const FileBuffer &buf;
+    size_t limit;
+    size_t size = 0;
+    size_t cost = 0;
+    bool over = false;
+    std::vector<std::pair<size_t,std::string>> ranges; // output to write there
+
+    DiffSink(const KnownContents &old, const FileBuffer &buf, size_t limit) : old(old), buf(buf), limit(limit) {}
+
+    void Write(const char *p, size_t n) {
+        size_t o = size;
+        size += n;
+        if(over) return;
+        size_t inside = o<old.size ? std::min(n, old.size-o) : 0;
+        old.Pieces(buf, o, inside, [&] (size_t off, const char *q, size_t m) {
+            const char *np = p+(off-o);
+            if(np==q || !memcmp(np, q, m)) return;
+            size_t a = 0, b = m;
+            while(np[a]==q[a]) ++a;
+            while(np[b-1]==q[b-1]) --b;
+            Add(off+a, np+a, b-a);
+        });
+        if(n>inside) Add(o+inside, p+inside, n-inside);
+    }
+    void Finish() {
+        if(size<old.size) Cost(old.size-size);
+    }
+    bool Same() const { return !over && ranges.empty() && size==old.size; }
+
+private:
+    void Add(size_t off, const char *p, size_t n) {
+        if(over) return;
+        if(ranges.size() && ranges.back().first+ranges.back().second.size()==off) ranges.back().second.append(p, n);
+        else ranges.emplace_back(off, std::string(p, n));
+        Cost(n);
+    }
+    void Cost(size_t n) {
+        cost += n;
+        if(cost>limit) {
+            over = true;
+            ranges.clear();
+        }
+    }
+};
+
+// hashes the output on its way to another sink, if any
+struct HashSink : Sink {
+    using Sink::Write;
+    Sink *next;
+    HashStream h;
+    HashSink(Sink *next = NULL) : next(next) {}
+    void Write(const char *p, size_t n) {
+        h.Update(p, n);
+        if(next) next->Write(p, n);
+    }
+};
+
+// output to a file descriptor with writev; pieces are referenced in place
+// until the next Flush, and small ones are copied together so that a call
+// covers many of them. Pieces of a mapped source buffer are evicted once
+// written, so that streaming a huge file through does not keep it resident
+struct FileWriter : Sink {
+    using Sink::Write;
+    static const size_t BUFSIZE = 64*1024, SMALL = 512, CHUNK = FileBuffer::EVICT_CHUNK;
+
+    int fd;
+    const FileBuffer *src;
+    std::unique_ptr<char[]> buf; // small pieces
+    size_t len = 0;
+    std::vector<struct iovec> iov;
+    size_t pending = 0; // bytes in iov
+    bool ok = true;
+
+    FileWriter(int fd, const FileBuffer *src = NULL) : fd(fd), src(src), buf(new char[BUFSIZE]) {}
+
+    void Write(const char *p, size_t n) {
+        while(n) {
+            if(n < SMALL) {
+                if(len+n > BUFSIZE) Flush();
+                char *d = buf.get()+len;
+                memcpy(d, p, n);
+                len += n;
+                add(d, n);
+                break;
+            }
+            size_t d = n<CHUNK ? n : CHUNK;
+            add(p, d);
+            p += d; n -= d;
+        }
+    }
+
+    bool Flush() {
+        put();
+        // the output mostly follows the source, so one range covers what
+        // this call wrote of it
+        if(src && src->maplen && src->size>CHUNK) {
+            const char *lo = src->data+src->size, *hi = src->data;
+            for(auto &v : iov) {
+                const char *p = (const char*)v.iov_base;
+                if(p<src->data || p>=src->data+src->size) continue;
+                lo = std::min(lo, p);
+                hi = std::max(hi, p+v.iov_len);
+            }
+            if(hi>lo) src->Evict(lo, hi-lo);
+        }
+        iov.clear();
+        len = pending = 0;
+        return ok;
+    }
+
+private:
+    // pieces that continue the previous one, like neighbouring blocks of the
+    // source, share its entry
+    void add(const char *p, size_t n) {
+        if(iov.size() && (char*)iov.back().iov_base+iov.back().iov_len==p) iov.back().iov_len += n;
+        else iov.push_back(iovec { (void*)p, n });
+        pending += n;
+        if(iov.size()>=IOV_MAX || pending>=CHUNK) Flush();
+    }
+    void put() {
+        struct iovec *v = iov.data();
+        int cnt = iov.size();
+        while(ok && cnt) {
+            ssize_t w = writev(fd, v, cnt);
+            if(w<0 && errno==EINTR) continue;
+            if(w<0) { ok = false; break; }
+            // skip what was written, which may end inside an entry
+            while(cnt && (size_t)w>=v->iov_len) { w -= v->iov_len; ++v; --cnt; }
+            if(cnt) { v->iov_base = (char*)v->iov_base+w; v->iov_len -= w; }
+        }
+    }
+};
+
+bool save_fsync = true; // --no-fsync turns it off
+
+// a file whose new contents have been written next to it, to be renamed
+// over it once every file saved together has been written
+struct Replacement {
+    std::string fname, target, tmp;
+    bool synced = false;
+};
+
+// a name for a temporary file next to target that can't be guessed, and so
+// not be set up in advance by someone else
+static std::string tmp_name(const std::string &target) {
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    thread_local std::mt19937_64 rng(std::random_device{}());
+    uint64_t x = rng();
+    std::string tmp = target + ".confy-tmp.";
+    for(int i=0;i<10;++i, x/=62) tmp += chars[x%62];
+    return tmp;
+}
+
+// create a new temporary file next to target, as mkstemp does, and set tmp
+// to its name; -1, with tmp empty, if that failed
+static int open_tmp(const std::string &target, mode_t mode, std::string &tmp) {
+    for(int tries=0; tries<100; ++tries) {
+        tmp = tmp_name(target);
+        int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, mode);
+        if(fd>=0) return fd;
+        if(errno!=EEXIST) break;
+    }
+    tmp.clear();
+    return -1;
+}
+
+// write the replacement for fname by streaming through fill, without
+// touching the existing file: a mapped buffer of the old contents may still
+// be in use
+bool WriteReplacement(const std::string &fname, const FileBuffer *src, const std::function<void(Sink&)> &fill, Replacement &r) {
+    r.fname = fname;
+    r.target = fname;
+    std::error_code ec;
+    auto canon = std::filesystem::canonical(fname, ec);
+    if(!ec) r.target = canon.string(); // write through symlinks
+
+    struct stat sb;
+    mode_t mode = 0644;
+    if(!stat(r.target.c_str(), &sb)) mode = sb.st_mode & 07777;
+
+    int fd = open_tmp(r.target, mode, r.tmp);
+    if(fd<0) {
+        fprintf(stderr,"ERROR: Could not create a temporary file for '%s'.\n",fname.c_str());
+        return false;
+    }
+    fchmod(fd, mode); // not subject to umask
+    FileWriter w(fd, src);
+    fill(w);
+    bool ok = w.Flush();
+    // start writeback now, so that the sync pass mostly waits for writes
+    // already under way
+    if(ok && save_fsync) sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    if(close(fd) || !ok) {
+        fprintf(stderr,"ERROR: Failed to write to '%s'.\n",fname.c_str());
+        unlink(r.tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// write the ranges into fname in place and cut it to size; the pages of
+// the loaded buffer those reach are detached first, so that it keeps the
+// old contents
+bool PatchFile(const std::string &fname, FileBuffer &buf, const std::vector<std::pair<size_t,std::string>> &ranges, size_t old_size, size_t size) {
+    bool ok = true;
+    for(auto &[off, bytes] : ranges) ok = ok && buf.Detach(off, bytes.size());
+    if(size<old_size) ok = ok && buf.Detach(size, old_size-size);
+    int fd = ok ? open(fname.c_str(), O_WRONLY|O_CLOEXEC) : -1;
+    if(fd<0) {
+        fprintf(stderr,"ERROR: Could not open file '%s' for writing.\n",fname.c_str());
+        return false;
+    }
+    for(auto &[off, bytes] : ranges) {
+        for(size_t done=0; ok && done<bytes.size(); ) {
+            ssize_t w = pwrite(fd, bytes.data()+done, bytes.size()-done, off+done);
+            if(w<0 && errno==EINTR) continue;
+            if(w<=0) ok = false;
+            else done += w;
+        }
+    }
+    if(ok && size!=old_size) ok = !ftruncate(fd, size);
+    if(ok && save_fsync) sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    if(close(fd) || !ok) {
+        fprintf(stderr,"ERROR: Failed to write to '%s'.\n",fname.c_str());
+        return false;
+    }
+    return true;
+}
+
+// keeps the output as pieces to be written later, as FileWriter does until
+// a flush; small ones are copied into storage of its own
+struct GatherSink : Sink {
+    using Sink::Write;
+    std::vector<struct iovec> iov;
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t used = 0, cap = 0;
+    size_t size = 0;
+
+    void Write(const char *p, size_t n) {
+        if(!n) return;
+        if(n < FileWriter::SMALL) {
+            if(used+n > cap) {
+                cap = !cap ? 4096 : cap*2<FileWriter::BUFSIZE ? cap*2 : FileWriter::BUFSIZE;
+                chunks.emplace_back(new char[cap]);
+                used = 0;
+            }
+            char *d = chunks.back().get()+used;
+            memcpy(d, p, n);
+            used += n;
+            p = d;
+        }
+        if(iov.size() && (char*)iov.back().iov_base+iov.back().iov_len==p) iov.back().iov_len += n;
+        else iov.push_back(iovec { (void*)p, n });
+        size += n;
+    }
+};
+
+// write what a writev at off left over after its first done bytes
+static bool write_rest(int fd, const struct iovec *v, int cnt, uint64_t off, size_t done) {
+    for(; cnt; ++v, --cnt) {
+        size_t skip = std::min(done, v->iov_len);
+        done -= skip;
+        off += skip;
+        for(size_t k=skip; k<v->iov_len; ) {
+            ssize_t w = pwrite(fd, (char*)v->iov_base+k, v->iov_len-k, off);
+            if(w<0 && errno==EINTR) continue;
+            if(w<=0) return false;
+            k += w;
+            off += w;
+        }
+    }
+    return true;
+}
+
+// write the replacements for many files at once, as WriteReplacement does
+// for one; fill(i, sink) streams the output for fnames[i]. Files go a
+// window at a time, with a batch each of stats, opens, writes, syncs and
+// closes, so they are synced here already. On failure the temporary files
+// written are left for DiscardReplacements
+bool WriteReplacements(const std::vector<std::string> &fnames, const std::function<void(size_t,Sink&)> &fill,
+                       std::vector<Replacement> &rs, WorkPool *pool = NULL) {
+    static const size_t WINDOW = 256;
+    rs.resize(fnames.size());
+    for(size_t w0=0; w0<fnames.size(); w0+=WINDOW) {
+        size_t n = std::min(WINDOW, fnames.size()-w0);
+
+        // symlinks, seen without following them, are resolved one by one
+        std::vector<struct statx> stx(n);
+        std::vector<IoOp> ops(n);
+        for(size_t i=0;i<n;++i) {
+            ops[i].kind = IO_STATX;
+            ops[i].fd = AT_FDCWD;
+            ops[i].path = fnames[w0+i].c_str();
+            ops[i].flags = AT_SYMLINK_NOFOLLOW;
+            ops[i].buf = &stx[i];
+        }
+        RunIoOps(ops, pool);
+        std::vector<mode_t> modes(n, 0644);
+        for(size_t i=0;i<n;++i) {
+            Replacement &r = rs[w0+i];
+            r.fname = r.target = fnames[w0+i];
+            if(!ops[i].res && S_ISLNK(stx[i].stx_mode)) {
+                std::error_code ec;
+                auto canon = std::filesystem::canonical(r.fname, ec);
+                if(!ec) r.target = canon.string();
+                struct stat sb;
+                if(!stat(r.target.c_str(), &sb)) modes[i] = sb.st_mode & 07777;
+            } else if(!ops[i].res) modes[i] = stx[i].stx_mode & 07777;
+            r.tmp = tmp_name(r.target);
+        }
+
+        for(size_t i=0;i<n;++i) {
+            ops[i] = IoOp { IO_OPENAT };
+            ops[i].path = rs[w0+i].tmp.c_str();
+            ops[i].flags = O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC;
+            ops[i].mode = modes[i];
+        }
+        RunIoOps(ops, pool);
+        std::vector<int> fds(n);
+        bool ok = true;
+        for(size_t i=0;i<n;++i) {
+            Replacement &r = rs[w0+i];
+            fds[i] = ops[i].res;
+            // the name was taken: try others, as mkstemp would
+            if(fds[i]==-EEXIST) fds[i] = open_tmp(r.target, modes[i], r.tmp);
+            if(fds[i]<0) {
+                r.tmp.clear(); // not ours to remove
+                fprintf(stderr,"ERROR: Could not create a temporary file for '%s'.\n",r.fname.c_str());
+                ok = false;
+            } else fchmod(fds[i], modes[i]); // not subject to umask
+        }
+
+        // the output of the whole window is gathered, then written with
+        // writevs of at most IOV_MAX pieces
+        std::vector<GatherSink> outs(ok ? n : 0);
+        std::vector<size_t> which;
+        ops.clear();
+        for(size_t i=0;i<outs.size();++i) {
+            fill(w0+i, outs[i]);
+            auto &iov = outs[i].iov;
+            uint64_t off = 0;
+            for(size_t k=0; k<iov.size(); k+=IOV_MAX) {
+                IoOp op { IO_WRITEV, fds[i] };
+                op.buf = &iov[k];
+                op.len = std::min<size_t>(IOV_MAX, iov.size()-k);
+                op.off = off;
+                for(unsigned j=0;j<op.len;++j) off += iov[k+j].iov_len;
+                ops.push_back(op);
+                which.push_back(i);
+            }
+        }
+        RunIoOps(ops, pool);
+        std::vector<uint8_t> failed(n);
+        for(size_t k=0;k<ops.size();++k) {
+            size_t want = 0;
+            const struct iovec *v = (const struct iovec*)ops[k].buf;
+            for(unsigned j=0;j<ops[k].len;++j) want += v[j].iov_len;
+            if(ops[k].res<0 || ((size_t)ops[k].res<want && !write_rest(ops[k].fd, v, ops[k].len, ops[k].off, ops[k].res)))
+                failed[which[k]] = 1;
+        }
+
+        ops.clear();
+        which.clear();
+        for(size_t i=0;i<n && save_fsync && ok;++i) {
+            ops.push_back(IoOp { IO_FSYNC, fds[i] });
+            which.push_back(i);
+        }
+        RunIoOps(ops, pool);
+        for(size_t k=0;k<ops.size();++k)
+            if(ops[k].res) failed[which[k]] = 1;
+
+        ops.clear();
+        which.clear();
+        for(size_t i=0;i<n;++i) {
+            if(fds[i]<0) continue;
+            ops.push_back(IoOp { IO_CLOSE, fds[i] });
+            which.push_back(i);
+        }
+        RunIoOps(ops, pool);
+        for(size_t k=0;k<ops.size();++k)
+            if(ops[k].res) failed[which[k]] = 1;
+
+        for(size_t i=0;i<n;++i) {
+            if(failed[i]) {
+                fprintf(stderr,"ERROR: Failed to write to '%s'.\n",rs[w0+i].fname.c_str());
+                ok = false;
+            }
+            rs[w0+i].synced = save_fsync;
+        }
+        if(!ok) return false;
+    }
+    return true;
+}
+
+void DiscardReplacements(const std::vector<Replacement> &rs) {
+    for(auto &r : rs)
+        if(r.tmp.size()) unlink(r.tmp.c_str());
+}
+
+static bool fsync_path(const std::string &path, int flags) {
+    int fd = open(path.c_str(), flags|O_CLOEXEC);
+    if(fd<0) return false;
+    bool ok = !fsync(fd);
+    close(fd);
+    return ok;
+}
+
+// put the written replacements in place: all are synced in one pass before
+// any is renamed, so that after a crash each file holds either its old or
+// its new contents, and a failure up to there leaves every file as it was.
+// Files patched in place are synced in the same pass; those are only as
+// safe as the patch writes themselves. The directories are synced once at
+// the end to make the renames durable
+bool CommitReplacements(const std::vector<Replacement> &rs, const std::vector<std::string> &patched, WorkPool *pool = NULL) {
+    if(save_fsync) {
+        for(auto &r : rs) {
+            if(!r.synced && !fsync_path(r.tmp, O_RDONLY)) {
+                fprintf(stderr,"ERROR: Failed to write to '%s'.\n",r.fname.c_str());
+                DiscardReplacements(rs);
+                return false;
+            }
+        }
+        for(auto &fname : patched) {
+            if(!fsync_path(fname, O_RDONLY)) {
+                fprintf(stderr,"ERROR: Failed to write to '%s'.\n",fname.c_str());
+                DiscardReplacements(rs);
+                return false;
+            }
+        }
+    }
+    bool ok = true;
+    std::vector<IoOp> ops(rs.size());
+    for(size_t i=0;i<rs.size();++i) {
+        ops[i].kind = IO_RENAMEAT;
+        ops[i].path = rs[i].tmp.c_str();
+        ops[i].path2 = rs[i].target.c_str();
+    }
+    RunIoOps(ops, pool);
+    std::set<std::string> dirs;
+    for(size_t i=0;i<rs.size();++i) {
+        if(ops[i].res) {
+            fprintf(stderr,"ERROR: Could not replace '%s'.\n",rs[i].fname.c_str());
+            unlink(rs[i].tmp.c_str());
+            ok = false;
+            continue;
+        }
+        dirs.insert(std::filesystem::path(rs[i].target).parent_path().string());
+    }
+    if(save_fsync)
+        for(auto &d : dirs) fsync_path(d.empty() ? "." : d, O_RDONLY|O_DIRECTORY);
+    return ok;
+}
+
+// resident set size in bytes
+long current_rss() {
+    long pages = 0, resident = 0;
+    FILE *fl = fopen("/proc/self/statm", "r");
+    if(fl) {
+        if(fscanf(fl, "%ld %ld", &pages, &resident)!=2) resident = 0;
+        fclose(fl);
+    }
+    return resident*sysconf(_SC_PAGESIZE);
+}
+
+// of the calling thread, so that loads running in parallel count separately
+long page_faults() {
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_minflt + ru.ru_majflt;
+}
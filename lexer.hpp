@@ -0,0 +1,126 @@
+// tokenizer for metacode, run once over the M_META segments of a file
+
+enum TokKind : char {
+    TK_EOF=0,
+    TK_ERROR,
+    TK_IDENT,
+    TK_VAR,     // '$' <identifier>, the name may be empty
+    TK_NUMBER,
+    TK_QUOTED,  // including the quotes
+    // keywords
+    TK_IF, TK_ELSE, TK_TEMPLATE, TK_INTO, TK_INCLUDE, TK_HIDDEN,
+    TK_BOOL, TK_STRING, TK_INT, TK_FLOAT, TK_TRUE, TK_FALSE,
+    // operators and punctuation
+    TK_OROR, TK_ANDAND, TK_EQ, TK_NE, TK_LE, TK_LT, TK_GE, TK_GT,
+    TK_PLUS, TK_MINUS, TK_STAR, TK_SLASH, TK_PERCENT, TK_NOT,
+    TK_LPAREN, TK_RPAREN, TK_LBRACE, TK_RBRACE, TK_SEMI, TK_ASSIGN, TK_COMMA, TK_COLON
+};
+
+struct Token {
+    offs_t start, len;
+    TokKind kind;
+};
+
+TokKind keyword_kind(std::string_view w) {
+    static const std::pair<const char*, TokKind> keywords[] = {
+        { "if", TK_IF }, { "else", TK_ELSE }, { "template", TK_TEMPLATE }, { "into", TK_INTO },
+        { "include", TK_INCLUDE }, { "hidden", TK_HIDDEN }, { "bool", TK_BOOL }, { "string", TK_STRING },
+        { "int", TK_INT }, { "float", TK_FLOAT }, { "true", TK_TRUE }, { "false", TK_FALSE }
+    };
+    for(auto &[kw,k] : keywords)
+        if(w == kw) return k;
+    return TK_IDENT;
+}
+
+// operator or punctuation starting at s, longest first; sets *len
+TokKind punct_kind(const char *s, offs_t avail, offs_t *len) {
+    static const std::pair<const char*, TokKind> two[] = {
+        { "||", TK_OROR }, { "&&", TK_ANDAND }, { "==", TK_EQ }, { "!=", TK_NE }, { "<=", TK_LE }, { ">=", TK_GE }
+    };
+    if(avail>=2) {
+        for(auto &[op,k] : two)
+            if(s[0]==op[0] && s[1]==op[1]) { *len=2; return k; }
+    }
+    *len=1;
+    switch(s[0]) {
+    case '<': return TK_LT;
+    case '>': return TK_GT;
+    case '+': return TK_PLUS;
+    case '-': return TK_MINUS;
+    case '*': return TK_STAR;
+    case '/': return TK_SLASH;
+    case '%': return TK_PERCENT;
+    case '!': return TK_NOT;
+    case '(': return TK_LPAREN;
+    case ')': return TK_RPAREN;
+    case '{': return TK_LBRACE;
+    case '}': return TK_RBRACE;
+    case ';': return TK_SEMI;
+    case '=': return TK_ASSIGN;
+    case ',': return TK_COMMA;
+    case ':': return TK_COLON;
+    default: return TK_ERROR;
+    }
+}
+
+struct TokenList {
+    std::vector<Token> toks;
+    mutable int hint = 0; // last token looked up; the parser mostly moves forward
+
+    // tokenize [pos,end), which must lie within one metacode run
+    void LexRange(const char *s, offs_t pos, offs_t end) {
+        while(1) {
+            pos += span_while(s, pos, end, IsSpace());
+            if(pos>=end || !s[pos]) break;
+            char c = s[pos];
+            Token t { pos, 1, TK_ERROR };
+            if(c=='$') {
+                t.len = 1+span_while(s, pos+1, end, IsIdentChar());
+                t.kind = TK_VAR;
+            } else if(c=='\"') {
+                offs_t d = span_while(s, pos+1, end, IsQuotedChar());
+                if(pos+1+d<end && s[pos+1+d]=='\"') {
+                    t.len = d+2;
+                    t.kind = TK_QUOTED;
+                }
+            } else if((c>='0' && c<='9') || c=='.') {
+                char *e;
+                strtod(s+pos, &e);
+                if(e>s+pos && e<=s+end) {
+                    t.len = e-(s+pos);
+                    t.kind = TK_NUMBER;
+                }
+            } else if(IsIdentChar()(c)) {
+                t.len = span_while(s, pos, end, IsIdentChar());
+                t.kind = keyword_kind(std::string_view(s+pos, t.len));
+            } else {
+                t.kind = punct_kind(s+pos, end-pos, &t.len);
+            }
+            toks.push_back(t);
+            pos += t.len;
+        }
+    }
+
+    void Lex(const char *s, const SegMap &segs) {
+        toks.clear();
+        hint = 0;
+        for(auto &sg : segs.segs)
+            if(sg.kind==Mask::M_META) LexRange(s, sg.start, sg.start+sg.len);
+    }
+
+    // token starting exactly at pos, or NULL
+    const Token *at(offs_t pos) const {
+        int n = toks.size();
+        if(hint<n && toks[hint].start==pos) return &toks[hint];
+        if(hint+1<n && toks[hint+1].start==pos) return &toks[++hint];
+        int lo=0, hi=n;
+        while(lo<hi) {
+            int mid=(lo+hi)/2;
+            if(toks[mid].start<pos) lo=mid+1;
+            else hi=mid;
+        }
+        if(lo==n || toks[lo].start!=pos) return NULL;
+        hint=lo;
+        return &toks[lo];
+    }
+};
@@ -1,70 +1,134 @@
-// parser components
+// byte offset or length within a file, which may be larger than 2 GiB
+typedef int64_t offs_t;
 
-int eat_whitespace(const char *s, const char *m, int pos) {
-    int ret = 0;
-    while(m[pos]==0 && (s[pos]==' ' || s[pos]=='\t' || s[pos]=='\r' || s[pos]=='\n')) {
-        ++ret;
-        ++pos;
+// segmentation of a file into runs of one Mask kind each, as produced by colourBlocks
+struct Segment {
+    offs_t start, len;
+    Mask kind;
+};
+
+struct SegMap {
+    std::vector<Segment> segs;
+    mutable int hint = 0; // last segment looked up; the parser mostly moves forward
+
+    // append a run; runs must be painted in order and tile the file
+    void paint(offs_t pos, offs_t d, Mask kind) {
+        if(d<=0) return;
+        if(segs.size() && segs.back().kind==kind && segs.back().start+segs.back().len==pos)
+            segs.back().len+=d;
+        else
+            segs.push_back(Segment { pos, d, kind });
     }
-    return ret;
+
+    // index of the segment containing pos, or -1
+    int find(offs_t pos) const {
+        int n = segs.size();
+        if(hint<n && segs[hint].start<=pos) {
+            if(pos<segs[hint].start+segs[hint].len) return hint;
+            if(hint+1<n && pos<segs[hint+1].start+segs[hint+1].len) return ++hint;
+        }
+        int lo=0, hi=n;
+        while(lo<hi) {
+            int mid=(lo+hi)/2;
+            if(segs[mid].start+segs[mid].len<=pos) lo=mid+1;
+            else hi=mid;
+        }
+        if(lo==n || segs[lo].start>pos) return -1;
+        return hint=lo;
+    }
+
+    Mask at(offs_t pos) const {
+        int i=find(pos);
+        return i<0 ? Mask::M_PROTECTED : segs[i].kind;
+    }
+
+    // number of bytes from pos to the end of its run if the run is of the given kind, else 0
+    offs_t runLength(offs_t pos, Mask kind) const {
+        int i=find(pos);
+        if(i<0 || segs[i].kind!=kind) return 0;
+        return segs[i].start+segs[i].len-pos;
+    }
+};
+
+// parser components; a NULL segment map means the whole input is metacode
+
+// end of the metacode run containing pos
+offs_t meta_end(const SegMap *m, offs_t pos) {
+    if(!m) return INT64_MAX;
+    return pos+m->runLength(pos, Mask::M_META);
 }
-int match_string(const char *s, const char *m, int pos, const char *ref) {
+
+// character class predicates, as types so that the scanning loops below inline them
+struct IsSpace {
+    bool operator()(char c) const { return c==' ' || c=='\t' || c=='\r' || c=='\n'; }
+};
+struct IsAlphanum {
+    bool operator()(char c) const { return (c>='a' && c<='z')||(c>='A' && c<='Z')||(c>='0'&&c<='9'); }
+};
+struct IsIdentChar {
+    bool operator()(char c) const { return IsAlphanum()(c) || c=='_'; }
+};
+struct IsQuotedChar {
+    bool operator()(char c) const { return !(c=='\"' || c==0 || c=='\n'); }
+};
+
+bool is_alphanum(char c) { return IsAlphanum()(c); }
+bool is_alphanum_(char c) { return IsIdentChar()(c); }
+
+// length of the run of characters satisfying test starting at pos, stopping at NUL or end
+template<typename Pred>
+offs_t span_while(const char *s, offs_t pos, offs_t end, Pred test) {
+    offs_t d=pos;
+    while(d<end && s[d] && test(s[d])) ++d;
+    return d-pos;
+}
+
+offs_t eat_whitespace(const char *s, const SegMap *m, offs_t pos) {
+    return span_while(s, pos, meta_end(m, pos), IsSpace());
+}
+int match_string(const char *s, const SegMap *m, offs_t pos, const char *ref) {
     int refl = strlen(ref);
     if(!strncmp(s+pos, ref, refl)) {
-        for(int i=pos; i<(pos+refl); ++i) {
-            if(m[i]) return 0;
-        }
+        if(refl && meta_end(m, pos)<pos+refl) return 0;
         return refl;
     } else {
         return 0;
     }
 }
-int match_string_after_ws(const char *s, const char *m, int pos, const char *ref) {
-    int d;
+offs_t match_string_after_ws(const char *s, const SegMap *m, offs_t pos, const char *ref) {
+    offs_t d;
     d = eat_whitespace(s,m,pos);
     pos += d;
     return d+match_string(s,m,pos,ref);
 }
 
-int match_eof(const char *s, const char *m, int pos) {
+// the end of the input is the same in every segment, so the map is unused
+int match_eof(const char *s, const SegMap *, offs_t pos) {
     return !s[pos];
 }
-int match_while(const char *s, const char *m, int pos, std::function<bool (const char *, const char*, int pos)> test) {
-    int d=0;
-    while(s[pos+d] && test(s,m,pos+d)) {
-        ++d;
-    }
-    return d;
+// stops at the end of the metacode run, as the other matchers do
+template<typename Pred>
+offs_t match_while(const char *s, const SegMap *m, offs_t pos, Pred test) {
+    return span_while(s, pos, meta_end(m, pos), test);
 }
-std::string capture_while(const char *s, const char *m, int *pos, std::function<bool (const char *, const char*, int pos)> test) {
-    int d=match_while(s,m,*pos,test);
-    std::string ret = std::string(s+*pos, d);
+template<typename Pred>
+std::string_view capture_while(const char *s, const SegMap *m, offs_t *pos, Pred test) {
+    offs_t d=match_while(s,m,*pos,test);
+    std::string_view ret(s+*pos, d);
     (*pos)+=d;
     return ret;
 }
-bool is_alphanum(char c) {
-    return (c>='a' && c<='z')||(c>='A' && c<='Z')||(c>='0'&&c<='9');
-}
-bool is_alphanum_(char c) {
-    return (c>='a' && c<='z')||(c>='A' && c<='Z')||(c>='0'&&c<='9')||(c=='_');
-}
-std::function<bool (const char *, const char*, int pos)> is_mask_eq(char c) {
-    return [c] (const char *s, const char *m, int pos) { return m[pos]==c; };
-}
 
-std::string capture_ident(const char *s, const char *m, int *pos) {
-    return capture_while(s,m,pos,[] (const char *s, const char *m, int pos) { return is_alphanum_(s[pos]); });
+std::string_view capture_ident(const char *s, const SegMap *m, offs_t *pos) {
+    return capture_while(s,m,pos,IsIdentChar());
 }
-int try_capture_quoted(const char *s, const char *m, int pos0, std::string *res) {
-    int pos = pos0;
+offs_t try_capture_quoted(const char *s, const SegMap *m, offs_t pos0, std::string_view *res) {
+    offs_t pos = pos0;
     if(!match_string(s,m,pos,"\"")) return 0;
     pos++;
-    std::string ret = capture_while(s,m,&pos,[] (const char *s, const char *m, int pos) {
-                                        char c=s[pos];
-                                        return !(c=='\"' || c==0 || c=='\n'); });
+    std::string_view ret = capture_while(s,m,&pos,IsQuotedChar());
     if(!match_string(s,m,pos,"\"")) return 0;
     pos++;
     *res = ret;
     return pos-pos0;
 }
-
@@ -0,0 +1,104 @@
+// small work-stealing thread pool, used to load and parse files ahead of
+// their execution
+//
+// Every worker has its own queue. Tasks submitted from a worker go to the back
+// of that worker's queue and are taken from there LIFO, so a file's includes
+// tend to be parsed by the thread that discovered them; idle workers steal
+// from the front of other queues.
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+
+class WorkPool {
+    struct Queue {
+        std::mutex m;
+        std::deque<std::function<void()>> tasks;
+    };
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex m;
+    std::condition_variable cv;
+    int pending = 0; // tasks queued and not yet claimed
+    bool stop = false;
+    unsigned next = 0; // round robin for tasks from outside the pool
+
+    static thread_local int self; // index of the current worker, -1 elsewhere
+
+    // own queue from the back, then everyone else's from the front
+    bool pop(int i, std::function<void()> &fn) {
+        int n = queues.size();
+        for(int k=0;k<n;++k) {
+            Queue &q = *queues[(i+k)%n];
+            std::lock_guard<std::mutex> lk(q.m);
+            if(q.tasks.empty()) continue;
+            if(!k) {
+                fn = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                fn = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void run(int i) {
+        self = i;
+        while(1) {
+            {
+                std::unique_lock<std::mutex> lk(m);
+                cv.wait(lk, [&] { return pending>0 || stop; });
+                if(stop) return;
+                --pending;
+            }
+            // every claim is backed by a task pushed before pending was raised
+            std::function<void()> fn;
+            while(!pop(i, fn)) std::this_thread::yield();
+            fn();
+        }
+    }
+
+public:
+    WorkPool(int n = std::thread::hardware_concurrency()) {
+        if(n<1) n = 1;
+        for(int i=0;i<n;++i) queues.emplace_back(new Queue);
+        for(int i=0;i<n;++i) threads.emplace_back([this,i] { run(i); });
+    }
+    WorkPool(const WorkPool&) = delete;
+    WorkPool &operator=(const WorkPool&) = delete;
+
+    // waits for running tasks, drops queued ones
+    ~WorkPool() {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            stop = true;
+        }
+        cv.notify_all();
+        for(auto &t : threads) t.join();
+    }
+
+    void Submit(std::function<void()> fn) {
+        int i = self;
+        if(i<0) {
+            std::lock_guard<std::mutex> lk(m);
+            if(stop) return;
+            i = next++ % queues.size();
+        }
+        {
+            std::lock_guard<std::mutex> lk(queues[i]->m);
+            queues[i]->tasks.push_back(std::move(fn));
+        }
+        {
+            std::lock_guard<std::mutex> lk(m);
+            ++pending;
+        }
+        cv.notify_one();
+    }
+};
+
+thread_local int WorkPool::self = -1;
@@ -0,0 +1,157 @@
+// vectorized scanning for delimiter candidates
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONFY_X86 1
+#endif
+
+// set of up to 8 distinct bytes that may start a delimiter
+struct ByteSet {
+    char c[8];
+    int n = 0;
+
+    void add(char ch) {
+        for(int i=0;i<n;++i) if(c[i]==ch) return;
+        if(n<8) c[n++]=ch;
+    }
+    void addFirst(const std::string &delim) {
+        if(delim.length()) add(delim[0]);
+    }
+    bool has(char ch) const {
+        for(int i=0;i<n;++i) if(c[i]==ch) return true;
+        return false;
+    }
+};
+
+// first index in [pos,end) whose byte is in set, or end if there is none
+static offs_t scan_scalar(const char *s, offs_t pos, offs_t end, const ByteSet &set) {
+    while(pos<end && !set.has(s[pos])) ++pos;
+    return pos;
+}
+
+#ifdef CONFY_X86
+__attribute__((target("sse2")))
+static offs_t scan_sse2(const char *s, offs_t pos, offs_t end, const ByteSet &set) {
+    __m128i needles[8];
+    for(int i=0;i<set.n;++i) needles[i] = _mm_set1_epi8(set.c[i]);
+    while(pos+16<=end) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s+pos));
+        __m128i hit = _mm_cmpeq_epi8(v, needles[0]);
+        for(int i=1;i<set.n;++i) hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, needles[i]));
+        int bits = _mm_movemask_epi8(hit);
+        if(bits) return pos + __builtin_ctz(bits);
+        pos+=16;
+    }
+    return scan_scalar(s, pos, end, set);
+}
+
+__attribute__((target("avx2")))
+static offs_t scan_avx2(const char *s, offs_t pos, offs_t end, const ByteSet &set) {
+    __m256i needles[8];
+    for(int i=0;i<set.n;++i) needles[i] = _mm256_set1_epi8(set.c[i]);
+    while(pos+32<=end) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s+pos));
+        __m256i hit = _mm256_cmpeq_epi8(v, needles[0]);
+        for(int i=1;i<set.n;++i) hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, needles[i]));
+        unsigned bits = (unsigned)_mm256_movemask_epi8(hit);
+        if(bits) return pos + __builtin_ctz(bits);
+        pos+=32;
+    }
+    return scan_sse2(s, pos, end, set);
+}
+#endif
+
+offs_t scan_for_any(const char *s, offs_t pos, offs_t end, const ByteSet &set) {
+    if(!set.n) return end;
+#ifdef CONFY_X86
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if(has_avx2) return scan_avx2(s, pos, end, set);
+    return scan_sse2(s, pos, end, set);
+#else
+    return scan_scalar(s, pos, end, set);
+#endif
+}
+
+// Aho-Corasick automaton over a handful of delimiters, compiled into a full
+// byte-indexed DFA so that matching costs one table lookup per input byte.
+struct DelimDFA {
+    std::vector<int> next;              // state*256+byte -> state
+    std::vector<int> depth;             // length of the prefix each state stands for
+    std::vector<std::vector<int>> out;  // patterns ending in each state, including via fail links
+    std::vector<int> lens;              // pattern lengths
+    int maxlen;
+    ByteSet first;                      // bytes leaving the root state
+
+    // patterns are given in priority order; empty patterns never match
+    void Build(const std::vector<std::string> &pats) {
+        next.assign(256, -1);
+        depth.assign(1, 0);
+        out.assign(1, {});
+        lens.clear();
+        maxlen = 0;
+        first = ByteSet();
+        // trie
+        for(size_t p=0;p<pats.size();++p) {
+            lens.push_back(pats[p].length());
+            if(lens[p]>maxlen) maxlen = lens[p];
+            if(!pats[p].length()) continue;
+            first.add(pats[p][0]);
+            int s=0;
+            for(unsigned char c : pats[p]) {
+                if(next[s*256+c]<0) {
+                    next[s*256+c] = depth.size();
+                    next.resize(next.size()+256, -1);
+                    depth.push_back(depth[s]+1);
+                    out.push_back({});
+                }
+                s = next[s*256+c];
+            }
+            out[s].push_back(p);
+        }
+        // fail links in BFS order, filling in missing transitions as we go
+        std::vector<int> fail(depth.size(), 0), queue;
+        for(int c=0;c<256;++c) {
+            if(next[c]<0) next[c]=0;
+            else queue.push_back(next[c]);
+        }
+        for(size_t qi=0;qi<queue.size();++qi) {
+            int s=queue[qi];
+            for(int p : out[fail[s]]) out[s].push_back(p);
+            for(int c=0;c<256;++c) {
+                int t=next[s*256+c];
+                if(t<0) next[s*256+c] = next[fail[s]*256+c];
+                else {
+                    fail[t] = next[fail[s]*256+c];
+                    queue.push_back(t);
+                }
+            }
+        }
+    }
+
+    // leftmost match starting in [pos,end) and ending before end, ties going
+    // to the earlier pattern; returns the pattern index and sets *mpos, or -1
+    int Find(const char *s, offs_t pos, offs_t end, offs_t *mpos) const {
+        int state=0, best=-1;
+        offs_t bestStart=end, i=pos;
+        while(i<end) {
+            if(!state) {
+                if(best>=0) break;
+                // nothing in flight, skip ahead to the next candidate first byte
+                if((i=scan_for_any(s, i, end, first))>=end) break;
+            }
+            state = next[state*256+(unsigned char)s[i]];
+            ++i;
+            for(int p : out[state]) {
+                offs_t start = i-lens[p];
+                if(start<bestStart || (start==bestStart && p<best)) {
+                    best=p;
+                    bestStart=start;
+                }
+            }
+            // nothing still in flight can start at or before the best match
+            if(best>=0 && i-depth[state]>bestStart) break;
+        }
+        if(best>=0) *mpos=bestStart;
+        return best;
+    }
+};
@@ -0,0 +1,355 @@
+// resident daemon
+//
+// confy --serve <root> keeps the files of root loaded and answers the
+// commands of batch mode, plus "reload", over a unix socket: one command
+// line in, one reply line out ("list" adds its variables). Clients share
+// the one state, so a set made by one is seen by all; sets are saved on
+// "save" or "commit", and when the daemon is stopped with SIGINT or
+// SIGTERM. The directories of the loaded files are watched, and when any
+// of the files changes on disk from something other than the daemon's own
+// saves, everything is loaded again, with the sets not yet saved made
+// again on top. confy --client sends its arguments as one command, or
+// else each line of stdin, and prints the replies.
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+
+static volatile sig_atomic_t serve_stop = 0;
+
+// $XDG_RUNTIME_DIR/confy.sock, or /tmp/confy-<uid>.sock
+static std::string default_socket() {
+    if(const char *dir = getenv("XDG_RUNTIME_DIR"); dir && *dir)
+        return std::string(dir)+"/confy.sock";
+    return "/tmp/confy-"+std::to_string(getuid())+".sock";
+}
+
+static bool socket_addr(const char *path, struct sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path)>=sizeof(addr.sun_path)) {
+        fprintf(stderr,"ERROR: socket path '%s' is too long\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+// whole buffer, or false
+static bool send_all(int fd, const char *p, size_t n) {
+    while(n) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+        if(r<0 && errno==EINTR) continue;
+        if(r<=0) return false;
+        p += r; n -= r;
+    }
+    return true;
+}
+
+struct ConfyServer {
+    std::string root;
+    std::unique_ptr<ConfyState> st;
+    CommandSession session { NULL };
+    int listen_fd = -1, notify_fd = -1;
+    std::set<std::string> watched; // directories
+    size_t watched_files = 0;      // files whose directories are watched
+
+    // clients are never waited for: replies queue up in out until the
+    // socket takes them, and no more commands are read from one whose
+    // replies have piled up
+    struct Client {
+        int fd;
+        std::string in, out;
+        size_t sent = 0; // of out
+        bool eof = false;
+    };
+    std::vector<Client> clients;
+
+    static const size_t MAX_LINE = 1024*1024, MAX_OUT = 4*1024*1024;
+
+    ~ConfyServer() {
+        for(auto &c : clients) close(c.fd);
+        if(notify_fd>=0) close(notify_fd);
+        if(listen_fd>=0) close(listen_fd);
+    }
+
+    bool Load() {
+        auto fresh = std::make_unique<ConfyState>();
+        if(!fresh->LoadAndParseFile(root)) return false;
+        session.Rebase(fresh.get());
+        st = std::move(fresh);
+        watched_files = 0; // the old watches stay, for files that may come back
+        Watch();
+        return true;
+    }
+
+    // add watches for the directories of files loaded since the last call;
+    // none if inotify isn't there, which Run reported
+    void Watch() {
+        if(notify_fd<0) return;
+        for(; watched_files<st->files.size(); ++watched_files) {
+            const std::string &fname = st->files[watched_files].fname;
+            size_t slash = fname.rfind('/');
+            std::string dir = slash==std::string::npos ? "." : slash ? fname.substr(0, slash) : "/";
+            if(!watched.insert(dir).second) continue;
+            if(inotify_add_watch(notify_fd, dir.c_str(), IN_MODIFY|IN_ATTRIB|IN_CLOSE_WRITE|IN_CREATE|
+                                 IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR)<0)
+                fprintf(stderr,"ERROR: can't watch '%s' for changes: %s\n", dir.c_str(), strerror(errno));
+        }
+    }
+
+    // whether a file differs from how it was loaded or last saved
+    bool ChangedOnDisk() {
+        std::vector<int> fids;
+        for(int i=0;i<st->files.size();++i)
+            if(st->files[i].buf.regular) fids.push_back(i);
+        std::vector<struct statx> stx;
+        st->StatFiles(fids, stx);
+        for(size_t k=0;k<fids.size();++k) {
+            const KnownContents &disk = st->files[fids[k]].disk;
+            if(!stx[k].stx_mask || stx[k].stx_size!=disk.size || statx_mtime_ns(stx[k])!=disk.mtime_ns)
+                return true;
+        }
+        return false;
+    }
+
+    void Reload(const char *why) {
+        if(Load()) fprintf(stderr,"== reloaded '%s': %s ==\n", root.c_str(), why);
+        else fprintf(stderr,"ERROR: reloading '%s' failed, keeping what was loaded\n", root.c_str());
+    }
+
+    // events only say that something in a directory changed; the files
+    // themselves tell whether it was one of ours, and not our own save
+    void Notified() {
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        bool any = false;
+        while(read(notify_fd, buf, sizeof(buf))>0) any = true;
+        if(any && ChangedOnDisk()) Reload("files changed on disk");
+    }
+
+    std::string Reply(std::string_view line) {
+        std::string reply;
+        std::string_view rest = line;
+        std::string_view cmd = batch_word(rest);
+        if(cmd=="reload") {
+            if(!Load()) reply = session.Error("reloading '%s' failed", root.c_str());
+            else reply = "ok "+std::to_string(st->files.size())+" files";
+        } else if(!session.Handle(line, reply)) return reply;
+        Watch(); // a run can include files not loaded before
+        reply += '\n';
+        return reply;
+    }
+
+    // answer the complete lines read, as long as the replies don't pile up
+    void Process(Client &c) {
+        size_t start = 0, nl;
+        while(c.out.length()-c.sent<MAX_OUT && (nl = c.in.find('\n', start))!=std::string::npos) {
+            c.out += Reply(std::string_view(c.in).substr(start, nl-start));
+            start = nl+1;
+        }
+        c.in.erase(0, start);
+        if(c.eof && c.in.length() && c.in.find('\n')==std::string::npos) { // last line without a newline
+            c.out += Reply(c.in);
+            c.in.clear();
+        }
+    }
+
+    // false when the client is to be dropped
+    bool Readable(Client &c) {
+        char buf[4096];
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if(n<0) return errno==EINTR || errno==EAGAIN;
+        if(n>0) c.in.append(buf, n);
+        else c.eof = true;
+        Process(c);
+        if(c.in.length()>MAX_LINE && c.in.find('\n')==std::string::npos) return false;
+        return Writable(c);
+    }
+
+    bool Writable(Client &c) {
+        while(c.sent<c.out.length()) {
+            ssize_t r = send(c.fd, c.out.data()+c.sent, c.out.length()-c.sent, MSG_NOSIGNAL);
+            if(r<0 && errno==EINTR) continue;
+            if(r<0 && errno==EAGAIN) break;
+            if(r<=0) return false;
+            c.sent += r;
+        }
+        if(c.sent==c.out.length()) {
+            c.out.clear();
+            c.sent = 0;
+            if(c.in.length()) { // held back while the replies piled up
+                Process(c);
+                if(c.out.length()) return Writable(c);
+            }
+        } else if(c.sent>=MAX_OUT) {
+            c.out.erase(0, c.sent);
+            c.sent = 0;
+        }
+        return !c.eof || c.out.length() || c.in.length();
+    }
+
+    bool Listen(const char *path) {
+        struct sockaddr_un addr;
+        if(!socket_addr(path, addr)) return false;
+        listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if(listen_fd<0) {
+            fprintf(stderr,"ERROR: socket: %s\n", strerror(errno));
+            return false;
+        }
+        // a socket left behind by a daemon that is gone is replaced
+        if(!connect(listen_fd, (struct sockaddr*)&addr, sizeof(addr))) {
+            fprintf(stderr,"ERROR: a daemon is already serving on '%s'\n", path);
+            return false;
+        }
+        close(listen_fd);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if(listen_fd<0) {
+            fprintf(stderr,"ERROR: socket: %s\n", strerror(errno));
+            return false;
+        }
+        struct stat sb;
+        if(!lstat(path, &sb) && S_ISSOCK(sb.st_mode)) unlink(path);
+        mode_t mask = umask(0077); // only for this user
+        int r = bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+        umask(mask);
+        if(r<0 || listen(listen_fd, 64)<0) {
+            fprintf(stderr,"ERROR: can't listen on '%s': %s\n", path, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    int Run(const char *path) {
+        notify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+        if(notify_fd<0) fprintf(stderr,"ERROR: inotify: %s, changes on disk need a reload\n", strerror(errno));
+        if(!Load()) return -3;
+        if(!Listen(path)) return -1;
+
+        struct sigaction sa = {};
+        sa.sa_handler = [] (int) { serve_stop = 1; };
+        sigaction(SIGINT, &sa, NULL); // without SA_RESTART, so poll returns
+        sigaction(SIGTERM, &sa, NULL);
+        fprintf(stderr,"== serving '%s' on '%s' ==\n", root.c_str(), path);
+
+        std::vector<struct pollfd> fds;
+        while(!serve_stop) {
+            fds.clear();
+            fds.push_back({ listen_fd, POLLIN, 0 });
+            fds.push_back({ notify_fd, POLLIN, 0 });
+            for(auto &c : clients) {
+                short ev = 0;
+                if(!c.eof && c.out.length()-c.sent<MAX_OUT) ev |= POLLIN;
+                if(c.sent<c.out.length()) ev |= POLLOUT;
+                fds.push_back({ c.fd, ev, 0 });
+            }
+            if(poll(fds.data(), fds.size(), -1)<0) {
+                if(errno==EINTR) continue;
+                fprintf(stderr,"ERROR: poll: %s\n", strerror(errno));
+                break;
+            }
+            // changes on disk first, so that requests see them
+            if(fds[1].revents) Notified();
+            for(size_t i=clients.size(); i--;) {
+                short re = fds[i+2].revents;
+                if(!re) continue;
+                bool keep = true;
+                if(re & (POLLIN|POLLHUP|POLLERR)) keep = Readable(clients[i]);
+                if(keep && (re & POLLOUT)) keep = Writable(clients[i]);
+                if(keep) continue;
+                close(clients[i].fd);
+                clients.erase(clients.begin()+i);
+            }
+            if(fds[0].revents & POLLIN) {
+                int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+                if(fd>=0) clients.push_back({ fd, {} });
+            }
+        }
+
+        unlink(path);
+        if(!session.Finish()) {
+            fprintf(stderr,"ERROR: saving on exit failed\n");
+            return -1;
+        }
+        return 0;
+    }
+};
+
+int serve(const char *root, const char *path) {
+    ConfyServer server;
+    server.root = root;
+    return server.Run(path);
+}
+
+// returns nonzero if a command failed or the daemon couldn't be reached
+int client(const char *path, int argc, char **argv) {
+    struct sockaddr_un addr;
+    if(!socket_addr(path, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if(fd<0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))<0) {
+        fprintf(stderr,"ERROR: can't connect to '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    std::string in;
+    // next line from the daemon, false if it went away
+    auto reply_line = [&] (std::string &line) {
+        size_t nl;
+        while((nl = in.find('\n'))==std::string::npos) {
+            char buf[4096];
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if(n<0 && errno==EINTR) continue;
+            if(n<=0) return false;
+            in.append(buf, n);
+        }
+        line.assign(in, 0, nl);
+        in.erase(0, nl+1);
+        return true;
+    };
+
+    int failed = 0;
+    auto command = [&] (std::string_view line) {
+        std::string_view rest = line;
+        std::string_view cmd = batch_word(rest);
+        if(cmd.empty() || cmd[0]=='#') return true; // no reply to wait for
+        std::string msg(line);
+        msg += '\n';
+        std::string reply;
+        if(!send_all(fd, msg.data(), msg.length()) || !reply_line(reply)) {
+            fprintf(stderr,"ERROR: the daemon on '%s' went away\n", path);
+            return false;
+        }
+        puts(reply.c_str());
+        if(reply.compare(0, 3, "ok ") || cmd!="list") {
+            if(reply.compare(0, 2, "ok")) ++failed;
+            return true;
+        }
+        for(long n = atol(reply.c_str()+3); n>0; --n) {
+            if(!reply_line(reply)) return false;
+            puts(reply.c_str());
+        }
+        return true;
+    };
+
+    bool ok = true;
+    if(argc>0) {
+        std::string line;
+        for(int i=0;i<argc;++i) {
+            if(i) line += ' ';
+            line += argv[i];
+        }
+        ok = command(line);
+    } else {
+        char *buf = NULL;
+        size_t cap = 0;
+        ssize_t len;
+        while(ok && (len = getline(&buf, &cap, stdin))>=0) {
+            ok = command(std::string_view(buf, len).substr(0, len && buf[len-1]=='\n' ? len-1 : len));
+            fflush(stdout);
+        }
+        free(buf);
+    }
+    close(fd);
+    return ok && !failed ? 0 : -1;
+}
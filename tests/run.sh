@@ -0,0 +1,49 @@
+#!/bin/sh
+# runs each case in tests/exec with incremental execution and with
+# --full-exec, and fails unless both give the same replies, errors and
+# files. Each case is a directory with main.txt, the files it includes,
+# a batch command file `commands` and, optionally, `expect`: patterns
+# that must each match a line of the standard error of a --check-exec
+# --stats run
+#
+#   tests/run.sh <confy>
+
+confy=$(realpath "${1:-./confy}")
+cases=$(dirname "$0")/exec
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+# run <case> <name> <options>: runs the case in a fresh copy, in $tmp/<name>
+run() {
+    rm -rf "$tmp/$2"
+    cp -r "$1" "$tmp/$2"
+    (cd "$tmp/$2" && "$confy" --no-cache $3 main.txt batch commands >../$2.out 2>../$2.err)
+    echo "exit $?" >>"$tmp/$2.out"
+}
+
+for c in "$cases"/*/; do
+    name=$(basename "$c")
+    run "$c" inc ""
+    run "$c" full --full-exec
+    run "$c" check "--check-exec --stats"
+    ok=1
+    for f in out err; do
+        if ! cmp -s "$tmp/inc.$f" "$tmp/full.$f"; then
+            echo "$name: std$f differs from --full-exec:"; diff "$tmp/full.$f" "$tmp/inc.$f"; ok=0
+        fi
+    done
+    if ! diff -r "$tmp/inc" "$tmp/full" >"$tmp/diff"; then
+        echo "$name: files differ from --full-exec:"; cat "$tmp/diff"; ok=0
+    fi
+    if grep "EXEC MISMATCH" "$tmp/check.err"; then ok=0; fi
+    if [ -f "$c/expect" ]; then
+        while IFS= read -r pat; do
+            if ! grep -q -e "$pat" "$tmp/check.err"; then
+                echo "$name: no line of standard error matches '$pat'"; ok=0
+            fi
+        done <"$c/expect"
+    fi
+    if [ $ok = 1 ]; then echo "ok   $name"; else echo "FAIL $name"; failed=1; fi
+done
+exit $failed
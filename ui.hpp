@@ -67,7 +67,7 @@ void interact(ConfyState &st)
 
     // get max width of all displayed names
     int maxw = 1;
-    for(auto &n : st.varNames) {
+    for(auto &n : st.varSlots) {
         auto &nd = st.vars[n].display;
         if(nd.length() > maxw) maxw = nd.length();
     }
@@ -80,6 +80,14 @@ void interact(ConfyState &st)
     STB_TexteditState test;
     std::vector<uint32_t> tecontents;
 
+    std::string notice; // result of the last save
+    bool saved_quit = false;
+    auto save = [&] {
+        int unchanged, n = st.SaveAll(&unchanged);
+        if(n<0) notice = "Save failed";
+        else notice = "Saved: " + std::to_string(n) + " written, " + std::to_string(unchanged) + " unchanged";
+    };
+
     while(1) {
         int h = tb_height(), w = tb_width();
         if(!editing) tb_hide_cursor();
@@ -90,10 +98,10 @@ void interact(ConfyState &st)
         int sel_y=0; // computed y-position of selection in list
         std::string statusline; // status line to emit at bottom
         for(i=0;i<h-4;++i) {
-            while(ri < st.varNames.size() && st.vars[st.varNames[ri]].hidden) ++ri;
-            if(ri==st.varNames.size()) break;
+            while(ri < st.varSlots.size() && st.vars[st.varSlots[ri]].hidden) ++ri;
+            if(ri==st.varSlots.size()) break;
 
-            ConfyVar &v = st.vars[st.varNames[ri]];
+            ConfyVar &v = st.vars[st.varSlots[ri]];
 
             bool selected = false;
             if(sel == ri) {
@@ -109,7 +117,7 @@ void interact(ConfyState &st)
                 case T_STRING: statusline+="string"; break;
                 }
                 statusline+=" $";
-                statusline+=st.varNames[ri];
+                statusline+=symbols.Name(st.varSlots[ri]);
             }
 
             int bg,bghi,fg,fghi;
@@ -125,11 +133,11 @@ void interact(ConfyState &st)
             tb_printf(1, i+1, fg, bg, "     %s ", v.display.c_str());
             if(v.val.t == T_BOOL) {
                 tb_printf(1, i+1, fghi, bghi, " [ ] ");
-                if(v.val.b)
+                if(v.val.AsBool())
                     tb_printf(3, i+1, fg, bg, "X");
             } else { //if(v.val.t == T_INT) {
                 if(!editing || !selected) {
-                    tb_printf(5 + maxw + 3, i+1, TB_DEFAULT, 0, "%s", v.val.s.c_str());
+                    tb_printf(5 + maxw + 3, i+1, TB_DEFAULT, 0, "%s", v.val.Text().c_str());
                 } else {
                     //tb_printf(5 + maxw + 3, i+1, TB_DEFAULT, 0, "%100s", " ");
                     for(int j=0;j<tecontents.size();++j) {
@@ -151,6 +159,7 @@ void interact(ConfyState &st)
         tb_printf(24, i+3, TB_DIM|TB_DEFAULT, 0, "Abort");
         tb_printf(31, i+3, TB_DIM|TB_REVERSE, 0, "Ctrl+S");
         tb_printf(38, i+3, TB_DIM|TB_DEFAULT, 0, "Save");
+        tb_printf(45, i+3, TB_DIM, 0, "%s", notice.c_str());
 
 
 
@@ -164,48 +173,51 @@ void interact(ConfyState &st)
             case TB_KEY_ARROW_UP:
                 sel0=sel;
                 if(sel > 0) --sel;
-                while(sel > 0 && st.vars[st.varNames[sel]].hidden) --sel;
-                if(st.vars[st.varNames[sel]].hidden) sel=sel0; // bumped into end on hidden, revert
+                while(sel > 0 && st.vars[st.varSlots[sel]].hidden) --sel;
+                if(st.vars[st.varSlots[sel]].hidden) sel=sel0; // bumped into end on hidden, revert
                 // check if we also need to scroll up
                 if(sel_y<2) {
                     if(scroll>0) --scroll;
-                    while(scroll > 0 && st.vars[st.varNames[scroll]].hidden) --scroll;
+                    while(scroll > 0 && st.vars[st.varSlots[scroll]].hidden) --scroll;
                     // allow scrolling up to hidden
                 }
                 editing=false;
                 break;
             case TB_KEY_ARROW_DOWN:
                 sel0=sel;
-                if(sel < (st.varNames.size()-1)) ++sel;
-                while(sel < (st.varNames.size()-1) && st.vars[st.varNames[sel]].hidden) ++sel;
-                if(st.vars[st.varNames[sel]].hidden) sel=sel0; // bumped into end on hidden, revert
+                if(sel < (st.varSlots.size()-1)) ++sel;
+                while(sel < (st.varSlots.size()-1) && st.vars[st.varSlots[sel]].hidden) ++sel;
+                if(st.vars[st.varSlots[sel]].hidden) sel=sel0; // bumped into end on hidden, revert
                 // check if we also need to scroll down
                 if(sel_y>(h-8)) {
-                    if(scroll<st.varNames.size()-3) ++scroll;
-                    while(scroll<st.varNames.size()-3 && st.vars[st.varNames[scroll]].hidden) ++scroll;
+                    if(scroll<st.varSlots.size()-3) ++scroll;
+                    while(scroll<st.varSlots.size()-3 && st.vars[st.varSlots[scroll]].hidden) ++scroll;
                 }
 
                 editing=false;
                 break;
             case TB_KEY_ENTER:
-                if(st.vars[st.varNames[sel]].val.t == T_BOOL) {
-                    st.vars[st.varNames[sel]].val.b = !st.vars[st.varNames[sel]].val.b;
-                    // st.files[st.vars[st.varNames[sel]].fl].s->Execute(st.vars[st.varNames[sel]].fl, &st, true);
-                    st.files[0].s->Execute(0, &st, true); // just execute root
+                if(st.vars[st.varSlots[sel]].val.t == T_BOOL) {
+                    st.vars[st.varSlots[sel]].val = boolVal(!st.vars[st.varSlots[sel]].val.AsBool());
+                    st.exec.Edit(st.varSlots[sel]);
+                    // st.files[st.vars[st.varSlots[sel]].fl].s->Execute(st.vars[st.varSlots[sel]].fl, &st, true);
+                    st.Update(0); // just execute root
                 } else if(!editing) {
                     editing=true;
                     stb_textedit_initialize_state(&test, 1);
-                    u8tou32(&tecontents, st.vars[st.varNames[sel]].val.s);
+                    u8tou32(&tecontents, st.vars[st.varSlots[sel]].val.Text());
                 } else if(editing) {
                     editing=false;
-                    st.vars[st.varNames[sel]].val.s = u32tou8(&tecontents);
-                    st.vars[st.varNames[sel]].val.f = atof(st.vars[st.varNames[sel]].val.s.c_str());
-                    st.vars[st.varNames[sel]].val.i = atoi(st.vars[st.varNames[sel]].val.s.c_str());
-                    st.vars[st.varNames[sel]].val.b = (bool)st.vars[st.varNames[sel]].val.i;
-                    if(st.vars[st.varNames[sel]].val.t != T_STRING)
-                        st.vars[st.varNames[sel]].val.s = st.vars[st.varNames[sel]].val.Render();
-                    //st.files[st.vars[st.varNames[sel]].fl].s->Execute(st.vars[st.varNames[sel]].fl, &st, true);
-                    st.files[0].s->Execute(0, &st, true); // just execute root
+                    std::string text = u32tou8(&tecontents);
+                    ConfyVal &val = st.vars[st.varSlots[sel]].val;
+                    switch(val.t) {
+                    case T_INT: val = intVal(atoi(text.c_str())); break;
+                    case T_FLOAT: val = floatVal(atof(text.c_str())); break;
+                    default: val = st.Keep(strVal(text));
+                    }
+                    st.exec.Edit(st.varSlots[sel]);
+                    //st.files[st.vars[st.varSlots[sel]].fl].s->Execute(st.vars[st.varSlots[sel]].fl, &st, true);
+                    st.Update(0); // just execute root
                 }
                 break;
             case TB_KEY_ESC:
@@ -214,19 +226,15 @@ void interact(ConfyState &st)
                 break;
             case TB_KEY_CTRL_S:
                 if(st.files.size())
-                    st.files[0].s->Execute(0, &st, true);
-                for(int i=0;i<st.files.size();++i) {
-                    st.SaveFile(i);
-                }
+                    st.Update(0);
+                save();
                 break;
             case TB_KEY_CTRL_C: 
                 // only execute root file, active includes will cascade
                 if(st.files.size())
-                    st.files[0].s->Execute(0, &st, true);
-                for(int i=0;i<st.files.size();++i) {
-//                    st.files[i].s->Execute(i, &st, true);
-                    st.SaveFile(i);
-                }
+                    st.Update(0);
+                save();
+                saved_quit = true;
                 goto abort_interact;
             case TB_KEY_CTRL_D: goto abort_interact;
             default:
@@ -244,4 +252,5 @@ void interact(ConfyState &st)
 abort_interact:
 
     tb_shutdown();
+    if(saved_quit) printf("%s\n", notice.c_str());
 }
@@ -0,0 +1,273 @@
+// batched file system calls
+//
+// Independent operations on many files (opening, stat, reads and writes,
+// syncs, renames) are handed to the kernel together through io_uring, set
+// up with raw system calls. Every thread gets a ring of its own on first
+// use. Where io_uring is missing, lacks one of the operations, or is turned
+// off with --no-uring, the same operations run as plain calls, spread over
+// a WorkPool if one is given.
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+bool io_uring_enabled = true; // --no-uring turns it off
+
+enum IoKind : uint8_t {
+    IO_OPENAT,  // res = openat(AT_FDCWD, path, flags, mode)
+    IO_STATX,   // res = statx(fd, path, flags, STATX_BASIC_STATS, stx)
+    IO_READ,    // res = pread(fd, buf, len, off)
+    IO_WRITEV,  // res = pwritev(fd, iov, len, off)
+    IO_FSYNC,   // res = fsync(fd)
+    IO_CLOSE,   // res = close(fd)
+    IO_RENAMEAT // res = rename(path, path2)
+};
+
+// one operation; res is its result, or -errno
+struct IoOp {
+    IoKind kind;
+    int fd = -1;
+    const char *path = NULL, *path2 = NULL;
+    int flags = 0;
+    mode_t mode = 0;
+    void *buf = NULL; // data, iovecs or struct statx
+    unsigned len = 0;
+    uint64_t off = 0;
+    int res = 0;
+};
+
+static void run_io_op(IoOp &op) {
+    long r = 0;
+    switch(op.kind) {
+    case IO_OPENAT: r = openat(AT_FDCWD, op.path, op.flags, op.mode); break;
+    case IO_STATX: r = statx(op.fd, op.path, op.flags, STATX_BASIC_STATS, (struct statx*)op.buf); break;
+    case IO_READ: r = pread(op.fd, op.buf, op.len, op.off); break;
+    case IO_WRITEV: r = pwritev(op.fd, (const struct iovec*)op.buf, op.len, op.off); break;
+    case IO_FSYNC: r = fsync(op.fd); break;
+    case IO_CLOSE: r = close(op.fd); break;
+    case IO_RENAMEAT: r = rename(op.path, op.path2); break;
+    }
+    op.res = r<0 ? -errno : r;
+}
+
+struct IoRing {
+    int fd = -1;
+    bool failed = false; // setup was tried and didn't work
+    unsigned entries = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes = NULL;
+    struct io_uring_cqe *cqes = NULL;
+    void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+    size_t sq_len = 0, cq_len = 0;
+
+    IoRing() = default;
+    IoRing(const IoRing&) = delete;
+    IoRing &operator=(const IoRing&) = delete;
+    ~IoRing() { Close(); }
+
+    void Close() {
+        if(sqes) munmap(sqes, entries*sizeof(struct io_uring_sqe));
+        if(cq_ptr!=MAP_FAILED && cq_ptr!=sq_ptr) munmap(cq_ptr, cq_len);
+        if(sq_ptr!=MAP_FAILED) munmap(sq_ptr, sq_len);
+        if(fd>=0) close(fd);
+        fd = -1;
+        sqes = NULL;
+        sq_ptr = cq_ptr = MAP_FAILED;
+    }
+
+    // whether the kernel runs every operation of IoKind
+    bool Probe() {
+        static const uint8_t needed[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITEV,
+                                          IORING_OP_FSYNC, IORING_OP_CLOSE, IORING_OP_RENAMEAT };
+        size_t len = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+        std::unique_ptr<char[]> mem(new char[len]());
+        struct io_uring_probe *p = (struct io_uring_probe*)mem.get();
+        if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, p, 256)<0) return false;
+        for(uint8_t op : needed)
+            if(op>p->last_op || !(p->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+        return true;
+    }
+
+    bool Init(unsigned n) {
+        struct io_uring_params p = {};
+        fd = syscall(__NR_io_uring_setup, n, &p);
+        if(fd<0) return false;
+        entries = p.sq_entries;
+        sq_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if(single) sq_len = cq_len = std::max(sq_len, cq_len);
+        sq_ptr = mmap(NULL, sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if(sq_ptr==MAP_FAILED) return false;
+        cq_ptr = single ? sq_ptr : mmap(NULL, cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(cq_ptr==MAP_FAILED) return false;
+        void *s = mmap(NULL, entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+        if(s==MAP_FAILED) return false;
+        sqes = (struct io_uring_sqe*)s;
+
+        char *sq = (char*)sq_ptr, *cq = (char*)cq_ptr;
+        sq_head = (unsigned*)(sq+p.sq_off.head);
+        sq_tail = (unsigned*)(sq+p.sq_off.tail);
+        sq_mask = (unsigned*)(sq+p.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq+p.sq_off.array);
+        cq_head = (unsigned*)(cq+p.cq_off.head);
+        cq_tail = (unsigned*)(cq+p.cq_off.tail);
+        cq_mask = (unsigned*)(cq+p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+        return Probe();
+    }
+
+    // set up on first use; false if io_uring can't be used
+    bool Ready() {
+        if(fd>=0) return true;
+        if(failed || !io_uring_enabled) return false;
+        if(!Init(256)) {
+            Close();
+            failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    void Prepare(struct io_uring_sqe *sqe, const IoOp &op, uint64_t tag) {
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = tag;
+        switch(op.kind) {
+        case IO_OPENAT:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)op.path;
+            sqe->open_flags = op.flags;
+            sqe->len = op.mode;
+            break;
+        case IO_STATX:
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = op.fd;
+            sqe->addr = (uintptr_t)op.path;
+            sqe->statx_flags = op.flags;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (uintptr_t)op.buf;
+            break;
+        case IO_READ:
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = op.fd;
+            sqe->addr = (uintptr_t)op.buf;
+            sqe->len = op.len;
+            sqe->off = op.off;
+            break;
+        case IO_WRITEV:
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = op.fd;
+            sqe->addr = (uintptr_t)op.buf;
+            sqe->len = op.len;
+            sqe->off = op.off;
+            break;
+        case IO_FSYNC:
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = op.fd;
+            break;
+        case IO_CLOSE:
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = op.fd;
+            break;
+        case IO_RENAMEAT:
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)op.path;
+            sqe->len = AT_FDCWD;
+            sqe->addr2 = (uintptr_t)op.path2;
+            break;
+        }
+    }
+
+    // keeps up to a ring's worth of operations in flight until all are
+    // done. If the ring stops working, what it hasn't taken yet runs as
+    // plain calls
+    void Run(std::vector<IoOp> &ops) {
+        size_t next = 0, done = 0;
+        unsigned inflight = 0, waiting = 0; // taken by the kernel, and queued but not yet taken
+        while(done<ops.size()) {
+            unsigned tail = *sq_tail;
+            while(next<ops.size() && inflight+waiting<entries) {
+                unsigned at = tail & *sq_mask;
+                Prepare(&sqes[at], ops[next], next);
+                sq_array[at] = at;
+                ++tail; ++waiting; ++next;
+            }
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+            int r = syscall(__NR_io_uring_enter, fd, waiting, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if(r>=0) {
+                inflight += r;
+                waiting -= r;
+            } else if(errno!=EINTR && errno!=EAGAIN && errno!=EBUSY && !inflight) {
+                __atomic_store_n(sq_tail, tail-waiting, __ATOMIC_RELEASE);
+                for(size_t i=next-waiting; i<ops.size(); ++i) run_io_op(ops[i]);
+                return;
+            }
+
+            unsigned head = *cq_head;
+            while(head!=__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+                ops[cqe->user_data].res = cqe->res;
+                ++head; ++done; --inflight;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+};
+
+static IoRing &thread_ring() {
+    static thread_local IoRing ring;
+    return ring;
+}
+
+// whether operations go through io_uring on this thread
+bool io_batched() {
+    return thread_ring().Ready();
+}
+
+// run independent operations, filling in each one's res
+void RunIoOps(std::vector<IoOp> &ops, WorkPool *pool = NULL) {
+    if(ops.empty()) return;
+    IoRing &ring = thread_ring();
+    if(ring.Ready()) {
+        ring.Run(ops);
+        return;
+    }
+
+    if(!pool || ops.size()<8) {
+        for(auto &op : ops) run_io_op(op);
+        return;
+    }
+    // workers that start after everything is done find nothing left to take
+    struct Shared {
+        std::atomic<size_t> next { 0 };
+        size_t done = 0;
+        std::mutex m;
+        std::condition_variable cv;
+    };
+    auto sh = std::make_shared<Shared>();
+    IoOp *data = ops.data();
+    size_t n = ops.size();
+    auto work = [sh, data, n] {
+        size_t i, k = 0;
+        while((i = sh->next++)<n) {
+            run_io_op(data[i]);
+            ++k;
+        }
+        if(!k) return;
+        std::lock_guard<std::mutex> lk(sh->m);
+        sh->done += k;
+        sh->cv.notify_all();
+    };
+    for(int i=0;i<8;++i) pool->Submit(work);
+    work();
+    std::unique_lock<std::mutex> lk(sh->m);
+    sh->cv.wait(lk, [&] { return sh->done==n; });
+}